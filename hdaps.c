@@ -31,12 +31,42 @@
 #include <linux/input.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/timer.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
 #include <linux/dmi.h>
 #include <linux/jiffies.h>
+#include <linux/hwmon.h>
+#include <linux/miscdevice.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/compat.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "thinkpad_ec.h"
+#include "hdaps.h"
 #include <linux/pci_ids.h>
 #include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+#include <uapi/linux/sched/types.h> /* struct sched_param */
+#endif
+#if IS_REACHABLE(CONFIG_IIO_TRIGGERED_BUFFER) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#endif
+#if IS_REACHABLE(CONFIG_ATA)
+#include <linux/libata.h>
+#include <scsi/scsi_host.h>
+#include <scsi/scsi_device.h>
+#endif
 
 /* Embedded controller accelerometer read command and its result: */
 static const struct thinkpad_ec_row ec_accel_args =
@@ -47,8 +77,8 @@ static const struct thinkpad_ec_row ec_accel_args =
 #define EC_ACCEL_IDX_XPOS1	0x4	/*   x-axis position word */
 #define EC_ACCEL_IDX_TEMP1	0x6	/*   device temperature in Celsius */
 					/* Second readout, if READOUTS>=2: */
-#define EC_ACCEL_IDX_XPOS2	0x7	/*   y-axis position word */
-#define EC_ACCEL_IDX_YPOS2	0x9	/*   x-axis position word */
+#define EC_ACCEL_IDX_YPOS2	0x7	/*   y-axis position word */
+#define EC_ACCEL_IDX_XPOS2	0x9	/*   x-axis position word */
 #define EC_ACCEL_IDX_TEMP2	0xb	/*   device temperature in Celsius */
 #define EC_ACCEL_IDX_QUEUED	0xc	/* Number of queued readouts left */
 #define EC_ACCEL_IDX_KMACT	0xd	/* keyboard or mouse activity */
@@ -62,7 +92,11 @@ static const struct thinkpad_ec_row ec_accel_args =
 
 #define HDAPS_INPUT_FUZZ	4	/* input event threshold */
 #define HDAPS_INPUT_FLAT	4
+#define HDAPS_MAX_RATE		1000	/* max input_sampling_rate (Hz) */
+#define HDAPS_MAX_DRAIN		8	/* max EC reads per update */
+
 #define KMACT_REMEMBER_PERIOD   (HZ/10) /* keyboard/mouse persistence */
+#define HWMON_CACHE_PERIOD	HZ	/* max age of temperature for hwmon */
 
 /* Input IDs */
 #define HDAPS_INPUT_VENDOR	PCI_VENDOR_ID_IBM
@@ -82,7 +116,7 @@ static const struct thinkpad_ec_row ec_accel_args =
 #define HDAPS_ORIENT_UNDEFINED  0xFF   /* Placeholder during initialization */
 #define HDAPS_ORIENT_INVERT_Y   (HDAPS_ORIENT_INVERT_XY | HDAPS_ORIENT_INVERT_X)
 
-static struct timer_list hdaps_timer;
+static struct task_struct *hdaps_thread; /* sampler, while there are users */
 static struct platform_device *pdev;
 static struct input_dev *hdaps_idev;     /* joystick-like device with fuzz */
 static struct input_dev *hdaps_idev_raw; /* raw hdaps sensor readouts */
@@ -91,12 +125,17 @@ static int needs_calibration;
 
 /* Configuration: */
 static int sampling_rate = 50;       /* Sampling rate  */
+static int hdaps_rate = 50;          /* Rate actually used; see hdaps_retune */
 static int oversampling_ratio = 5;   /* Ratio between our sampling rate and
 				      * EC accelerometer sampling rate      */
 static int running_avg_filter_order = 2; /* EC running average filter order */
+static bool sampler_fifo;            /* run sampler thread as SCHED_FIFO */
+static unsigned int counts_per_g = 55; /* accelerometer scale, nominal */
 
 /* Latest state readout: */
 static int pos_x, pos_y;      /* position */
+static ktime_t pos_time;      /* capture time of pos_x, pos_y */
+static unsigned long pos_seq; /* number of readouts pushed so far */
 static int temperature;       /* temperature */
 static int stale_readout = 1; /* last read invalid */
 static int rest_x, rest_y;    /* calibrated rest position */
@@ -105,10 +144,108 @@ static int rest_x, rest_y;    /* calibrated rest position */
 static u64 last_keyboard_jiffies = INITIAL_JIFFIES;
 static u64 last_mouse_jiffies = INITIAL_JIFFIES;
 static u64 last_update_jiffies = INITIAL_JIFFIES;
+static ktime_t prefetch_issued; /* when our prefetch was requested; under
+				 * controller lock */
+static bool keyboard_active, mouse_active; /* as last sysfs_notify()ed */
+
+/* One accelerometer readout, as captured by the EC: */
+struct hdaps_sample {
+	ktime_t time;	/* estimated capture time */
+	int x, y;	/* position, after transform_axes() */
+	int fx, fy;	/* position, after the filter chain */
+	u8 temp;	/* device temperature in Celsius */
+	u8 kmact;	/* KEYBD_MASK and MOUSE_MASK activity bits */
+};
+
+static void hdaps_stream_push(const struct hdaps_sample *sample);
+static int hdaps_stream_max_rate(int *nrated);
+static void hdaps_ff_feed(const struct hdaps_sample *sample);
+static void hdaps_ff_reset(void);
 
-/* input device use count */
+/* sampler use count (input devices and stream readers) */
 static int hdaps_users;
-static DEFINE_MUTEX(hdaps_users_mtx);
+static bool hdaps_powered;	/* sensor powered up, see hdaps_power_up */
+static bool hdaps_resuming;	/* powered, but not reinitialized yet */
+static DEFINE_MUTEX(hdaps_users_mtx); /* also protects the above two */
+static unsigned int idle_timeout = 30; /* seconds before powering down */
+static int hdaps_power_get(void);
+
+/* Sampler statistics: */
+static unsigned long missed_deadlines; /* sampling periods skipped */
+static unsigned long overruns;         /* EC queue left undrained */
+
+/* Benchmark mode (debugfs "benchmark"): sampling quality measurements.
+ * Only the sampler thread and holders of the controller lock update these.
+ */
+#define HDAPS_BENCH_BINS	8
+#define HDAPS_BENCH_DEPTHS	17	/* EC queue depths 0..16 */
+
+/* Upper edges of the interval histogram bins, in percent of the period */
+static const unsigned int hdaps_bench_edges[HDAPS_BENCH_BINS - 1] = {
+	50, 90, 110, 150, 200, 400, 800
+};
+
+static struct {
+	bool on;
+	ktime_t started;
+	unsigned long ticks;		/* sampler wakeups */
+	unsigned long lock_busy;	/* thinkpad_ec_try_lock() failed */
+	unsigned long ec_busy;		/* first try found the EC not ready */
+	unsigned long not_prefetched;	/* __hdaps_update(1) gave -ENODATA */
+	unsigned long no_readouts;	/* EC answered with 0 readouts */
+	s64 late_sum, late_max;		/* wakeup latency past deadline, ns */
+	ktime_t last;			/* time of the last successful tick */
+	unsigned long intervals;	/* between successful ticks: */
+	s64 interval_sum, interval_min, interval_max;
+	unsigned long interval_hist[HDAPS_BENCH_BINS];
+	unsigned long depth[HDAPS_BENCH_DEPTHS]; /* EC queue depth per read */
+} bench; /* protected by the controller lock */
+
+/**
+ * hdaps_bench_wakeup - account a sampler tick
+ * @late: wakeup latency past the deadline, in ns
+ * @lock_busy: whether the controller lock had to be waited for
+ * @restart: first tick of the sampler thread
+ * Caller must hold controller lock.
+ */
+static void hdaps_bench_wakeup(s64 late, bool lock_busy, bool restart)
+{
+	if (restart)
+		bench.last = 0; /* don't measure intervals across the gap */
+	if (!bench.on)
+		return;
+	late = max_t(s64, late, 0);
+	++bench.ticks;
+	if (lock_busy)
+		++bench.lock_busy;
+	bench.late_sum += late;
+	bench.late_max = max(bench.late_max, late);
+}
+
+/* A sampler tick got new data. Caller must hold controller lock. */
+static void hdaps_bench_sampled(void)
+{
+	ktime_t now = ktime_get();
+	s64 interval;
+	unsigned int pct, bin;
+
+	if (!bench.on)
+		return;
+	if (bench.last) {
+		interval = ktime_to_ns(ktime_sub(now, bench.last));
+		pct = div64_s64(interval * 100 * hdaps_rate, NSEC_PER_SEC);
+		for (bin = 0; bin < HDAPS_BENCH_BINS - 1; ++bin)
+			if (pct < hdaps_bench_edges[bin])
+				break;
+		++bench.interval_hist[bin];
+		if (!bench.intervals || interval < bench.interval_min)
+			bench.interval_min = interval;
+		bench.interval_max = max(bench.interval_max, interval);
+		bench.interval_sum += interval;
+		++bench.intervals;
+	}
+	bench.last = now;
+}
 
 /* Some models require an axis transformation to the standard representation */
 static void transform_axes(int *x, int *y)
@@ -127,26 +264,193 @@ static void transform_axes(int *x, int *y)
 		*x = -*x;
 }
 
+/* Filter chain: optional smoothing stages applied to every readout after
+ * transform_axes(). The result is offered to /dev/hdaps readers next to
+ * the unfiltered position. Integer math only; IIR state is kept with
+ * HDAPS_FILTER_FRAC fractional bits. Chain and state are protected by the
+ * controller lock, which __hdaps_update() callers hold anyway.
+ */
+
+#define HDAPS_FILTER_STAGES	4
+#define HDAPS_FILTER_FRAC	8
+#define HDAPS_MEDIAN_MAX	9
+
+enum hdaps_filter_type {
+	HDAPS_FILTER_LOWPASS,	/* first-order IIR, time constant 2^param */
+	HDAPS_FILTER_HIGHPASS,	/* input minus the above, removes gravity */
+	HDAPS_FILTER_MEDIAN,	/* median of the last param readouts */
+};
+
+static const char * const hdaps_filter_names[] = {
+	[HDAPS_FILTER_LOWPASS] = "lowpass",
+	[HDAPS_FILTER_HIGHPASS] = "highpass",
+	[HDAPS_FILTER_MEDIAN] = "median",
+};
+
+struct hdaps_filter {
+	enum hdaps_filter_type type;
+	int param;
+	unsigned int pos, count;		/* history ring, or 0 if new */
+	int hist[2][HDAPS_MEDIAN_MAX];		/* median history per axis */
+	s32 acc[2];				/* IIR state per axis */
+};
+
+static struct hdaps_filter hdaps_filters[HDAPS_FILTER_STAGES];
+static int hdaps_nfilters;
+
+static int hdaps_median(const int *hist, unsigned int n)
+{
+	int v[HDAPS_MEDIAN_MAX];
+	unsigned int i, j;
+
+	for (i = 0; i < n; ++i) { /* insertion sort, n is tiny */
+		for (j = i; j > 0 && v[j-1] > hist[i]; --j)
+			v[j] = v[j-1];
+		v[j] = hist[i];
+	}
+	return v[n / 2];
+}
+
+static int hdaps_filter_step(struct hdaps_filter *f, int axis, int v)
+{
+	int lp;
+
+	if (f->type == HDAPS_FILTER_MEDIAN) {
+		f->hist[axis][f->pos] = v;
+		return hdaps_median(f->hist[axis],
+				    min_t(unsigned int, f->count + 1, f->param));
+	}
+	if (!f->count) /* start settled at the first readout */
+		f->acc[axis] = v * (1 << HDAPS_FILTER_FRAC);
+	f->acc[axis] += (v * (1 << HDAPS_FILTER_FRAC) - f->acc[axis]) >>
+			f->param;
+	lp = (f->acc[axis] + (1 << (HDAPS_FILTER_FRAC - 1))) >>
+	     HDAPS_FILTER_FRAC;
+	return f->type == HDAPS_FILTER_LOWPASS ? lp : v - lp;
+}
+
 /**
- * __hdaps_update - query current state, with locks already acquired
+ * hdaps_filter_batch - run readouts through the filter chain
+ * Sets fx, fy of each of the @n samples, which must be in capture order.
+ * Caller must hold controller lock.
+ */
+static void hdaps_filter_batch(struct hdaps_sample *samples, int n)
+{
+	struct hdaps_filter *f;
+	int i, k;
+
+	for (i = 0; i < n; ++i) {
+		samples[i].fx = samples[i].x;
+		samples[i].fy = samples[i].y;
+		for (k = 0; k < hdaps_nfilters; ++k) {
+			f = &hdaps_filters[k];
+			samples[i].fx = hdaps_filter_step(f, 0, samples[i].fx);
+			samples[i].fy = hdaps_filter_step(f, 1, samples[i].fy);
+			if (f->type == HDAPS_FILTER_MEDIAN)
+				f->pos = (f->pos + 1) % f->param;
+			if (f->count < HDAPS_MEDIAN_MAX)
+				++f->count;
+		}
+	}
+}
+
+/**
+ * hdaps_activity_notify - publish keyboard/mouse activity transitions
+ * Wakes up poll()ers of the keyboard_activity and mouse_activity sysfs
+ * files whenever their value changes, so idle-detection daemons can sleep
+ * until something happens instead of polling.
+ */
+static void hdaps_activity_notify(void)
+{
+	u64 now = get_jiffies_64();
+	bool kb = now < last_keyboard_jiffies + KMACT_REMEMBER_PERIOD;
+	bool ms = now < last_mouse_jiffies + KMACT_REMEMBER_PERIOD;
+
+	if (kb != keyboard_active) {
+		keyboard_active = kb;
+		sysfs_notify(&pdev->dev.kobj, NULL, "keyboard_activity");
+	}
+	if (ms != mouse_active) {
+		mouse_active = ms;
+		sysfs_notify(&pdev->dev.kobj, NULL, "mouse_activity");
+	}
+}
+
+/**
+ * hdaps_push_sample - publish a new readout
+ * Updates the latest state, which the input devices, sysfs and hwmon
+ * report. Samples must be pushed in capture order.
+ */
+static void hdaps_push_sample(const struct hdaps_sample *sample)
+{
+	pos_x = sample->x;
+	pos_y = sample->y;
+	pos_time = sample->time;
+	++pos_seq;
+	temperature = sample->temp;
+
+	/* Keyboard and mouse activity status is cleared as soon as it's read,
+	 * so applications will eat each other's events. Thus we remember any
+	 * event for KMACT_REMEMBER_PERIOD jiffies.
+	 */
+	if (sample->kmact & KEYBD_MASK)
+		last_keyboard_jiffies = get_jiffies_64();
+	if (sample->kmact & MOUSE_MASK)
+		last_mouse_jiffies = get_jiffies_64();
+
+	last_update_jiffies = get_jiffies_64();
+	stale_readout = 0;
+	if (needs_calibration) {
+		rest_x = pos_x;
+		rest_y = pos_y;
+		needs_calibration = 0;
+	}
+
+	hdaps_activity_notify();
+	hdaps_ff_feed(sample);
+	hdaps_stream_push(sample);
+}
+
+/* Read a little-endian signed word from an EC row */
+static s16 ec_s16(const struct thinkpad_ec_row *data, int idx)
+{
+	return (s16)(data->val[idx] | (data->val[idx+1] << 8));
+}
+
+/**
+ * hdaps_read_readouts - do one accelerometer read transaction
  * @fast: if nonzero, do one quick attempt without retries.
+ * @samples: receives up to 2 readouts, oldest first (times not set)
+ * @queued: receives the number of readouts still queued in the EC
+ * @issued: receives when the query was sent to the EC, which is when it
+ *   takes the readouts from its queue: at the prefetch, if the answer
+ *   comes from one, or else now.
  *
- * Query current accelerometer state and update global state variables.
- * Also prefetches the next query. Caller must hold controller lock.
+ * Returns the number of readouts, or a negative error code. Also
+ * prefetches the next query. Caller must hold controller lock.
  */
-static int __hdaps_update(int fast)
+static int hdaps_read_readouts(int fast, struct hdaps_sample *samples,
+			       int *queued, ktime_t *issued)
 {
-	/* Read data: */
 	struct thinkpad_ec_row data;
-	int ret;
+	int n, ret;
 
 	data.mask = (1 << EC_ACCEL_IDX_READOUTS) | (1 << EC_ACCEL_IDX_KMACT) |
 		    (3 << EC_ACCEL_IDX_YPOS1)    | (3 << EC_ACCEL_IDX_XPOS1) |
-		    (1 << EC_ACCEL_IDX_TEMP1)    | (1 << EC_ACCEL_IDX_RETVAL);
-	if (fast)
-		ret = thinkpad_ec_try_read_row(&ec_accel_args, &data);
-	else
+		    (1 << EC_ACCEL_IDX_TEMP1)    | (3 << EC_ACCEL_IDX_YPOS2) |
+		    (3 << EC_ACCEL_IDX_XPOS2)    | (1 << EC_ACCEL_IDX_TEMP2) |
+		    (1 << EC_ACCEL_IDX_QUEUED)   | (1 << EC_ACCEL_IDX_RETVAL);
+	/* Trying first also tells whether the answer is from our prefetch */
+	ret = thinkpad_ec_try_read_row(&ec_accel_args, &data);
+	if (bench.on && fast && ret == -EBUSY)
+		++bench.ec_busy;
+	*issued = prefetch_issued;
+	if (ret && !fast) {
+		if (ret != -EBUSY) /* not prefetched: read_row asks anew */
+			*issued = ktime_get();
 		ret = thinkpad_ec_read_row(&ec_accel_args, &data);
+	}
+	prefetch_issued = ktime_get();
 	thinkpad_ec_prefetch_row(&ec_accel_args); /* Prefetch even if error */
 	if (ret)
 		return ret;
@@ -158,33 +462,77 @@ static int __hdaps_update(int fast)
 		return -EIO;
 	}
 
-	if (data.val[EC_ACCEL_IDX_READOUTS] < 1)
+	n = data.val[EC_ACCEL_IDX_READOUTS];
+	if (n < 1) {
+		if (bench.on)
+			++bench.no_readouts;
 		return -EBUSY; /* no pending readout, try again later */
+	}
+	n = min(n, 2);
+	*queued = data.val[EC_ACCEL_IDX_QUEUED];
+	if (bench.on)
+		++bench.depth[min(*queued, HDAPS_BENCH_DEPTHS - 1)];
 
 	/* Parse position data: */
-	pos_x = *(s16 *)(data.val+EC_ACCEL_IDX_XPOS1);
-	pos_y = *(s16 *)(data.val+EC_ACCEL_IDX_YPOS1);
-	transform_axes(&pos_x, &pos_y);
-
-	/* Keyboard and mouse activity status is cleared as soon as it's read,
-	 * so applications will eat each other's events. Thus we remember any
-	 * event for KMACT_REMEMBER_PERIOD jiffies.
-	 */
-	if (data.val[EC_ACCEL_IDX_KMACT] & KEYBD_MASK)
-		last_keyboard_jiffies = get_jiffies_64();
-	if (data.val[EC_ACCEL_IDX_KMACT] & MOUSE_MASK)
-		last_mouse_jiffies = get_jiffies_64();
+	samples[0].x = ec_s16(&data, EC_ACCEL_IDX_XPOS1);
+	samples[0].y = ec_s16(&data, EC_ACCEL_IDX_YPOS1);
+	samples[0].temp = data.val[EC_ACCEL_IDX_TEMP1];
+	samples[0].kmact = 0;
+	if (n == 2) {
+		samples[1].x = ec_s16(&data, EC_ACCEL_IDX_XPOS2);
+		samples[1].y = ec_s16(&data, EC_ACCEL_IDX_YPOS2);
+		samples[1].temp = data.val[EC_ACCEL_IDX_TEMP2];
+	}
+	/* Activity is reported per transaction; attach it to the newest */
+	samples[n-1].kmact = data.val[EC_ACCEL_IDX_KMACT] &
+			     (KEYBD_MASK | MOUSE_MASK);
+	return n;
+}
 
-	temperature = data.val[EC_ACCEL_IDX_TEMP1];
+/**
+ * __hdaps_update - query current state, with locks already acquired
+ * @fast: if nonzero, do one quick attempt without retries.
+ *
+ * Drain the EC's readout queue: each transaction returns up to two
+ * readouts plus the number still queued, so keep reading (up to
+ * HDAPS_MAX_DRAIN times) until the queue is empty. The readouts are
+ * assumed to be EC_ACCEL_IDX_*1 before *2, and queued ones newer still;
+ * they are spaced by the EC sampling period. The newest was taken before
+ * the last query was sent, on average half an EC period before; that's
+ * its estimated capture time, however late the host got to read it.
+ * Each is passed to hdaps_push_sample(). Also prefetches the next query.
+ * Caller must hold controller lock.
+ */
+static int __hdaps_update(int fast)
+{
+	struct hdaps_sample batch[2 * HDAPS_MAX_DRAIN];
+	int i, n, reads, queued = 0, ret;
+	u64 ec_period;
+	ktime_t issued, newest;
 
-	last_update_jiffies = get_jiffies_64();
-	stale_readout = 0;
-	if (needs_calibration) {
-		rest_x = pos_x;
-		rest_y = pos_y;
-		needs_calibration = 0;
+	ret = hdaps_read_readouts(fast, batch, &queued, &issued);
+	if (ret < 0)
+		return ret;
+	n = ret;
+	for (reads = 1; queued > 0 && reads < HDAPS_MAX_DRAIN; ++reads) {
+		/* Follow-ups were just prefetched, so wait for them */
+		ret = hdaps_read_readouts(0, batch + n, &queued, &issued);
+		if (ret < 0)
+			break;
+		n += ret;
 	}
-
+	if (queued > 0)
+		++overruns;
+
+	ec_period = NSEC_PER_SEC / max(hdaps_rate * oversampling_ratio, 1);
+	newest = ktime_sub_ns(issued, ec_period / 2);
+	for (i = 0; i < n; ++i) {
+		transform_axes(&batch[i].x, &batch[i].y);
+		batch[i].time = ktime_sub_ns(newest, (n - 1 - i) * ec_period);
+	}
+	hdaps_filter_batch(batch, n);
+	for (i = 0; i < n; ++i)
+		hdaps_push_sample(&batch[i]);
 	return 0;
 }
 
@@ -201,8 +549,11 @@ static int hdaps_update(void)
 	u64 age = get_jiffies_64() - last_update_jiffies;
 	int total, ret;
 
-	if (!stale_readout && age < (9*HZ)/(10*sampling_rate))
+	if (!stale_readout && age < (9*HZ)/(10*hdaps_rate))
 		return 0; /* already updated recently */
+	ret = hdaps_power_get();
+	if (ret)
+		return ret;
 	for (total = 0; total < READ_TIMEOUT_MSECS; total += RETRY_MSECS) {
 		ret = thinkpad_ec_lock();
 		if (ret)
@@ -240,7 +591,7 @@ static int hdaps_set_power(int on)
  * hdaps_set_ec_config - set accelerometer parameters.
  * @ec_rate: embedded controller sampling rate
  * @order: embedded controller running average filter order
- * (Normally we have @ec_rate = sampling_rate * oversampling_ratio.)
+ * (Normally we have @ec_rate = hdaps_rate * oversampling_ratio.)
  * Returns zero on success and negative error code on failure.  Can sleep.
  */
 static int hdaps_set_ec_config(int ec_rate, int order)
@@ -269,6 +620,17 @@ static int hdaps_set_ec_config(int ec_rate, int order)
 	return 0;
 }
 
+/* hdaps_set_ec_config() for callers that don't hold the controller lock */
+static int hdaps_set_ec_config_locked(int ec_rate, int order)
+{
+	int ret = thinkpad_ec_lock();
+	if (ret)
+		return ret;
+	ret = hdaps_set_ec_config(ec_rate, order);
+	thinkpad_ec_unlock();
+	return ret;
+}
+
 /**
  * hdaps_get_ec_config - get accelerometer parameters.
  * @ec_rate: embedded controller sampling rate
@@ -371,7 +733,7 @@ static int hdaps_device_init(void)
 	if (hdaps_set_power(1))
 		{ FAILED_INIT("hdaps_set_power failed"); goto bad; }
 
-	if (hdaps_set_ec_config(sampling_rate*oversampling_ratio,
+	if (hdaps_set_ec_config(hdaps_rate*oversampling_ratio,
 				running_avg_filter_order))
 		{ FAILED_INIT("hdaps_set_ec_config failed"); goto bad; }
 
@@ -379,6 +741,7 @@ static int hdaps_device_init(void)
 	udelay(200);
 
 	/* Just prefetch instead of reading, to avoid ~1sec delay on load */
+	prefetch_issued = ktime_get();
 	ret = thinkpad_ec_prefetch_row(&ec_accel_args);
 	if (ret)
 		{ FAILED_INIT("initial prefetch failed"); goto bad; }
@@ -399,48 +762,208 @@ good:
 static int hdaps_device_shutdown(void)
 {
 	int ret;
+
+	ret = thinkpad_ec_lock();
+	if (ret)
+		return ret;
 	ret = hdaps_set_power(0);
 	if (ret) {
 		printk(KERN_WARNING "hdaps: cannot power off\n");
-		return ret;
+		goto out;
 	}
 	ret = hdaps_set_ec_config(0, 1);
 	if (ret)
 		printk(KERN_WARNING "hdaps: cannot stop EC sampling\n");
+out:
+	thinkpad_ec_unlock();
+	return ret;
+}
+
+/**
+ * hdaps_device_detect - check for the accelerometer, leaving it off
+ * Returns zero if present and negative error code otherwise. Can sleep.
+ */
+static int hdaps_device_detect(void)
+{
+	int ret;
+	u8 mode;
+
+	ret = thinkpad_ec_lock();
+	if (ret)
+		return ret;
+	ret = hdaps_get_ec_mode(&mode);
+	thinkpad_ec_unlock();
+	if (ret) {
+		FAILED_INIT("hdaps_get_ec_mode failed");
+		return -ENXIO;
+	}
+	printk(KERN_DEBUG "hdaps: initial mode latch is 0x%02x\n", mode);
+	if (mode == 0x00) {
+		FAILED_INIT("accelerometer not available");
+		return -ENXIO;
+	}
+	return 0;
+}
+
+/* Power management: the sensor is powered up by the first user or query,
+ * and powered down again after idle_timeout seconds without either.
+ */
+
+static void hdaps_idle(struct work_struct *work);
+static DECLARE_DELAYED_WORK(hdaps_idle_work, hdaps_idle);
+
+/* Is the sensor up and sampling? Caller must hold hdaps_users_mtx. */
+static bool hdaps_sensor_on(void)
+{
+	return hdaps_powered && !hdaps_resuming;
+}
+
+/* Power the sensor up, if needed. Caller must hold hdaps_users_mtx. */
+static int hdaps_power_up(void)
+{
+	int ret;
+
+	if (hdaps_resuming)
+		return -EAGAIN; /* not ready yet */
+	if (hdaps_powered)
+		return 0;
+	ret = hdaps_device_init();
+	if (ret)
+		return ret;
+	hdaps_powered = true;
+	return 0;
+}
+
+/* (Re)start the idle countdown if nobody uses the sampler. Caller must
+ * hold hdaps_users_mtx.
+ */
+static void hdaps_idle_arm(void)
+{
+	if (!hdaps_users && hdaps_powered && idle_timeout)
+		mod_delayed_work(system_freezable_wq, &hdaps_idle_work,
+				 (unsigned long)idle_timeout * HZ);
+}
+
+static void hdaps_idle(struct work_struct *work)
+{
+	mutex_lock(&hdaps_users_mtx);
+	if (!hdaps_users && hdaps_sensor_on()) {
+		hdaps_device_shutdown(); /* ignore errors, effect is negligible */
+		hdaps_powered = false;
+	}
+	mutex_unlock(&hdaps_users_mtx);
+}
+
+/**
+ * hdaps_power_get - make sure the sensor is powered, for a one-off query
+ * Unless the sampler has users, it's powered down again once idle.
+ */
+static int hdaps_power_get(void)
+{
+	int ret;
+
+	mutex_lock(&hdaps_users_mtx);
+	ret = hdaps_power_up();
+	if (!ret)
+		hdaps_idle_arm();
+	mutex_unlock(&hdaps_users_mtx);
 	return ret;
 }
 
+#define HDAPS_RESUME_TRIES	3	/* reinitialization attempts */
+#define HDAPS_RESUME_RETRY	HZ	/* between them */
+
+static void hdaps_resume_init(struct work_struct *work);
+static DECLARE_DELAYED_WORK(hdaps_resume_work, hdaps_resume_init);
+static int hdaps_resume_tries;	/* attempts left, under hdaps_users_mtx */
+
+/* Power down for good, on unload. Users must be gone. */
+static void hdaps_power_exit(void)
+{
+	cancel_delayed_work_sync(&hdaps_resume_work);
+	hdaps_resuming = false;
+	cancel_delayed_work_sync(&hdaps_idle_work);
+	if (hdaps_powered)
+		hdaps_device_shutdown(); /* ignore errors */
+	hdaps_powered = false;
+}
+
 /* Device model stuff */
 
 static int hdaps_probe(struct platform_device *dev)
 {
 	int ret;
 
-	ret = hdaps_device_init();
+	ret = hdaps_device_detect();
 	if (ret)
 		return ret;
 
-	printk(KERN_INFO "hdaps: device successfully initialized.\n");
+	printk(KERN_INFO "hdaps: device successfully detected.\n");
 	return 0;
 }
 
+static void hdaps_sampler_start(void);
+static void hdaps_sampler_stop(void);
+
 static int hdaps_suspend(struct platform_device *dev, pm_message_t state)
 {
+	/* In case we're suspended again before the last resume finished */
+	cancel_delayed_work_sync(&hdaps_resume_work);
+
 	/* Don't do hdaps polls until resume re-initializes the sensor. */
-	del_timer_sync(&hdaps_timer);
-	hdaps_device_shutdown(); /* ignore errors, effect is negligible */
+	mutex_lock(&hdaps_users_mtx);
+	hdaps_resuming = false;
+	hdaps_sampler_stop();
+	if (hdaps_powered)
+		hdaps_device_shutdown(); /* ignore errors, effect negligible */
+	mutex_unlock(&hdaps_users_mtx);
 	return 0;
 }
 
-static int hdaps_resume(struct platform_device *dev)
+/**
+ * hdaps_resume_init - reinitialize the sensor after resume
+ * Runs as a work item, so the EC commands and their retries don't hold
+ * up system resume (or contend with tp_smapi's resume there). Until it's
+ * done, queries fail with -EAGAIN and new users just wait for the sampler.
+ * Failures are retried a few times; after that the sensor is left off,
+ * and the next hdaps_user_get() tries to power it up again.
+ */
+static void hdaps_resume_init(struct work_struct *work)
 {
-	int ret = hdaps_device_init();
-	if (ret)
-		return ret;
+	int ret;
 
 	mutex_lock(&hdaps_users_mtx);
+	if (!hdaps_resuming)
+		goto out;
+	ret = hdaps_device_init();
+	if (ret && --hdaps_resume_tries > 0) {
+		queue_delayed_work(system_unbound_wq, &hdaps_resume_work,
+				   HDAPS_RESUME_RETRY);
+		goto out;
+	}
+	hdaps_resuming = false;
+	if (ret) {
+		printk(KERN_ERR "hdaps: cannot reinitialize after resume "
+		       "(ret=%d)\n", ret);
+		hdaps_powered = false;
+		goto out;
+	}
 	if (hdaps_users)
-		mod_timer(&hdaps_timer, jiffies + HZ/sampling_rate);
+		hdaps_sampler_start();
+	hdaps_idle_arm();
+out:
+	mutex_unlock(&hdaps_users_mtx);
+}
+
+static int hdaps_resume(struct platform_device *dev)
+{
+	/* Restore the state we had: powered if in use or not yet idle */
+	mutex_lock(&hdaps_users_mtx);
+	if (hdaps_powered) {
+		hdaps_resuming = true;
+		hdaps_resume_tries = HDAPS_RESUME_TRIES;
+		queue_delayed_work(system_unbound_wq, &hdaps_resume_work, 0);
+	}
 	mutex_unlock(&hdaps_users_mtx);
 	return 0;
 }
@@ -466,59 +989,186 @@ static void hdaps_calibrate(void)
 	/* If that fails, the mousedev poll will take care of things later. */
 }
 
-/* Timer handler for updating the input device. Runs in softirq context,
- * so avoid lenghty or blocking operations.
- */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-static void hdaps_mousedev_poll(unsigned long unused)
-#else
-static void hdaps_mousedev_poll(struct timer_list *unused)
+/* Report a position to an input device, stamped with its capture time */
+static void hdaps_report_dev(struct input_dev *idev, int x, int y)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,4,0)
+	input_set_timestamp(idev, pos_time);
 #endif
+	input_report_abs(idev, ABS_X, x);
+	input_report_abs(idev, ABS_Y, y);
+	input_sync(idev);
+}
+
+/**
+ * hdaps_report - report the latest readout to the input devices
+ * Only reports what changed since the last call, so readers aren't
+ * woken up while the machine sits still.
+ */
+static void hdaps_report(void)
+{
+	static int raw_x, raw_y, joy_x, joy_y;
+	static bool reported;
+
+	if (!reported || pos_x != raw_x || pos_y != raw_y) {
+		raw_x = pos_x;
+		raw_y = pos_y;
+		hdaps_report_dev(hdaps_idev_raw, raw_x, raw_y);
+	}
+	if (!reported || pos_x - rest_x != joy_x || pos_y - rest_y != joy_y) {
+		joy_x = pos_x - rest_x;
+		joy_y = pos_y - rest_y;
+		hdaps_report_dev(hdaps_idev, joy_x, joy_y);
+	}
+	reported = true;
+}
+
+/**
+ * hdaps_sample - take one sample for the sampler thread
+ * @deadline: when the sampler was due to wake up
+ * @restart: first sample since the sampler started
+ * Tries the controller lock without blocking first, since it's usually
+ * free, and otherwise waits for it.
+ */
+static void hdaps_sample(ktime_t deadline, bool restart)
 {
+	s64 late = ktime_to_ns(ktime_sub(ktime_get(), deadline));
+	bool lock_busy = false;
 	int ret;
 
 	stale_readout = 1;
 
-	/* Cannot sleep.  Try nonblockingly.  If we fail, try again later. */
-	if (thinkpad_ec_try_lock())
-		goto keep_active;
-
-	ret = __hdaps_update(1); /* fast update, we're in softirq context */
+	if (thinkpad_ec_try_lock()) {
+		lock_busy = true;
+		ret = thinkpad_ec_lock();
+		if (ret)
+			return;
+	}
+	hdaps_bench_wakeup(late, lock_busy, restart);
+	ret = __hdaps_update(1);
+	if (ret == -ENODATA) { /* not prefetched, e.g. after another EC user */
+		if (bench.on)
+			++bench.not_prefetched;
+		ret = __hdaps_update(0);
+	}
+	if (!ret)
+		hdaps_bench_sampled();
 	thinkpad_ec_unlock();
-	/* Any of "successful", "not yet ready" and "not prefetched"? */
-	if (ret != 0 && ret != -EBUSY && ret != -ENODATA) {
-		printk(KERN_ERR
-		       "hdaps: poll failed, disabling updates\n");
+	if (!ret) {
+		hdaps_report();
 		return;
 	}
+	/* Any of "not yet ready" and "not prefetched"? Nothing new, then. */
+	if (ret != -EBUSY && ret != -ENODATA)
+		printk_ratelimited(KERN_ERR "hdaps: poll failed (ret=%d)\n",
+				   ret);
+}
 
-keep_active:
-	/* Even if we failed now, pos_x,y may have been updated earlier: */
-	input_report_abs(hdaps_idev, ABS_X, pos_x - rest_x);
-	input_report_abs(hdaps_idev, ABS_Y, pos_y - rest_y);
-	input_sync(hdaps_idev);
-	input_report_abs(hdaps_idev_raw, ABS_X, pos_x);
-	input_report_abs(hdaps_idev_raw, ABS_Y, pos_y);
-	input_sync(hdaps_idev_raw);
-	mod_timer(&hdaps_timer, jiffies + HZ/sampling_rate);
+/**
+ * hdaps_sampler - sampler thread main loop
+ *
+ * Sleeps until absolute hrtimer deadlines, so the period is exact
+ * regardless of HZ and the time spent sampling. If sampling overran one
+ * or more periods, those deadlines are counted as missed and skipped.
+ */
+static int hdaps_sampler(void *unused)
+{
+	ktime_t next = ktime_get();
+	ktime_t now, deadline;
+	u64 period, missed;
+	bool restart = true;
+
+	while (!kthread_should_stop()) {
+		deadline = next;
+		period = NSEC_PER_SEC / hdaps_rate;
+		next = ktime_add_ns(next, period);
+
+		hdaps_sample(deadline, restart);
+		restart = false;
+
+		now = ktime_get();
+		if (ktime_after(now, next)) {
+			missed = div64_u64(ktime_to_ns(ktime_sub(now, next)),
+					   period) + 1;
+			missed_deadlines += missed;
+			next = ktime_add_ns(next, missed * period);
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
 }
 
+/* Start the sampler thread. Caller must hold hdaps_users_mtx. */
+static void hdaps_sampler_start(void)
+{
+	struct task_struct *thread;
 
-/* Sysfs Files */
+	if (hdaps_thread)
+		return;
+	hdaps_ff_reset(); /* don't compare against samples from before */
+	thread = kthread_run(hdaps_sampler, NULL, "khdapsd");
+	if (IS_ERR(thread)) {
+		printk(KERN_ERR "hdaps: cannot start sampler (ret=%ld)\n",
+		       PTR_ERR(thread));
+		return;
+	}
+	if (sampler_fifo) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+		sched_set_fifo(thread);
+#else
+		struct sched_param param = { .sched_priority = MAX_RT_PRIO/2 };
+		sched_setscheduler(thread, SCHED_FIFO, &param);
+#endif
+	}
+	hdaps_thread = thread;
+}
 
-static ssize_t hdaps_position_show(struct device *dev,
-				   struct device_attribute *attr, char *buf)
+/* Stop the sampler thread. Caller must hold hdaps_users_mtx. */
+static void hdaps_sampler_stop(void)
 {
-	int ret = hdaps_update();
-	if (ret)
-		return ret;
-	return sprintf(buf, "(%d,%d)\n", pos_x, pos_y);
+	if (!hdaps_thread)
+		return;
+	kthread_stop(hdaps_thread);
+	hdaps_thread = NULL;
+}
+
+
+/* Sysfs Files */
+
+#define HDAPS_FRESH_PERIODS 4 /* sampler readouts younger than this serve */
+
+/**
+ * hdaps_sysfs_update - make the latest state current enough for sysfs
+ * While the sampler is running and has a recent readout, use that
+ * instead of querying the EC, which can block for READ_TIMEOUT_MSECS.
+ */
+static int hdaps_sysfs_update(void)
+{
+	s64 age = ktime_to_ns(ktime_sub(ktime_get(), pos_time));
+
+	if (READ_ONCE(hdaps_thread) && pos_seq &&
+	    age < HDAPS_FRESH_PERIODS * (NSEC_PER_SEC / hdaps_rate))
+		return 0;
+	return hdaps_update();
+}
+
+static ssize_t hdaps_position_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	int ret = hdaps_sysfs_update();
+	if (ret)
+		return ret;
+	return sprintf(buf, "(%d,%d)\n", pos_x, pos_y);
 }
 
 static ssize_t hdaps_temp1_show(struct device *dev,
 				struct device_attribute *attr, char *buf)
 {
-	int ret = hdaps_update();
+	int ret = hdaps_sysfs_update();
 	if (ret)
 		return ret;
 	return sprintf(buf, "%d\n", temperature);
@@ -528,7 +1178,7 @@ static ssize_t hdaps_keyboard_activity_show(struct device *dev,
 					    struct device_attribute *attr,
 					    char *buf)
 {
-	int ret = hdaps_update();
+	int ret = hdaps_sysfs_update();
 	if (ret)
 		return ret;
 	return sprintf(buf, "%u\n",
@@ -539,13 +1189,29 @@ static ssize_t hdaps_mouse_activity_show(struct device *dev,
 					 struct device_attribute *attr,
 					 char *buf)
 {
-	int ret = hdaps_update();
+	int ret = hdaps_sysfs_update();
 	if (ret)
 		return ret;
 	return sprintf(buf, "%u\n",
 	   get_jiffies_64() < last_mouse_jiffies + KMACT_REMEMBER_PERIOD);
 }
 
+static ssize_t hdaps_sample_age_us_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	if (!pos_seq)
+		return -ENODATA;
+	return sprintf(buf, "%lld\n", div_s64(ktime_to_ns(ktime_sub(
+			ktime_get(), pos_time)), NSEC_PER_USEC));
+}
+
+static ssize_t hdaps_sample_seq_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", pos_seq);
+}
+
 static ssize_t hdaps_calibrate_show(struct device *dev,
 				    struct device_attribute *attr, char *buf)
 {
@@ -588,21 +1254,62 @@ static ssize_t hdaps_sampling_rate_show(
 	return sprintf(buf, "%d\n", sampling_rate);
 }
 
+/**
+ * hdaps_retune - run at the highest rate that any user wants
+ * Stream readers that asked for a rate of their own want that rate; all
+ * other users, and sysfs, want sampling_rate. Sets hdaps_rate and, if
+ * powered, the EC rate to match. Caller must hold hdaps_users_mtx.
+ */
+static int hdaps_retune(void)
+{
+	int nrated, ret;
+	int rate = hdaps_stream_max_rate(&nrated);
+
+	if (hdaps_users == 0 || hdaps_users > nrated)
+		rate = max(rate, sampling_rate);
+	rate = min(rate, 0xFFFF / oversampling_ratio);
+	if (rate == hdaps_rate)
+		return 0;
+	if (hdaps_sensor_on()) { /* else hdaps_device_init() sets it up */
+		ret = hdaps_set_ec_config_locked(rate*oversampling_ratio,
+						 running_avg_filter_order);
+		if (ret)
+			return ret;
+	}
+	hdaps_rate = rate;
+	return 0;
+}
+
+/* Set the sampling rate, and the EC rate to match. Can sleep. */
+static int hdaps_set_sampling_rate(int rate)
+{
+	int old, ret;
+	if (rate > HDAPS_MAX_RATE || rate <= 0 ||
+	    rate * oversampling_ratio > 0xFFFF) {
+		printk(KERN_WARNING
+		       "must have 0<input_sampling_rate<=%d\n", HDAPS_MAX_RATE);
+		return -EINVAL;
+	}
+	mutex_lock(&hdaps_users_mtx);
+	old = sampling_rate;
+	sampling_rate = rate;
+	ret = hdaps_retune();
+	if (ret)
+		sampling_rate = old;
+	mutex_unlock(&hdaps_users_mtx);
+	return ret;
+}
+
 static ssize_t hdaps_sampling_rate_store(
 	struct device *dev, struct device_attribute *attr,
 	const char *buf, size_t count)
 {
 	int rate, ret;
-	if (sscanf(buf, "%d", &rate) != 1 || rate > HZ || rate <= 0) {
-		printk(KERN_WARNING
-		       "must have 0<input_sampling_rate<=HZ=%d\n", HZ);
+	if (sscanf(buf, "%d", &rate) != 1)
 		return -EINVAL;
-	}
-	ret = hdaps_set_ec_config(rate*oversampling_ratio,
-				  running_avg_filter_order);
+	ret = hdaps_set_sampling_rate(rate);
 	if (ret)
 		return ret;
-	sampling_rate = rate;
 	return count;
 }
 
@@ -610,10 +1317,14 @@ static ssize_t hdaps_oversampling_ratio_show(
 	struct device *dev, struct device_attribute *attr, char *buf)
 {
 	int ec_rate, order;
-	int ret = hdaps_get_ec_config(&ec_rate, &order);
+	int ret;
+
+	if (!hdaps_sensor_on()) /* EC isn't sampling */
+		return sprintf(buf, "%u\n", oversampling_ratio);
+	ret = hdaps_get_ec_config(&ec_rate, &order);
 	if (ret)
 		return ret;
-	return sprintf(buf, "%u\n", ec_rate / sampling_rate);
+	return sprintf(buf, "%u\n", ec_rate / hdaps_rate);
 }
 
 static ssize_t hdaps_oversampling_ratio_store(
@@ -623,11 +1334,19 @@ static ssize_t hdaps_oversampling_ratio_store(
 	int ratio, ret;
 	if (sscanf(buf, "%d", &ratio) != 1 || ratio < 1)
 		return -EINVAL;
-	ret = hdaps_set_ec_config(sampling_rate*ratio,
-				  running_avg_filter_order);
+	mutex_lock(&hdaps_users_mtx);
+	if (hdaps_rate * ratio > 0xFFFF)
+		ret = -EINVAL;
+	else if (hdaps_sensor_on())
+		ret = hdaps_set_ec_config_locked(hdaps_rate*ratio,
+						 running_avg_filter_order);
+	else
+		ret = 0; /* applied at power-up */
+	if (!ret)
+		oversampling_ratio = ratio;
+	mutex_unlock(&hdaps_users_mtx);
 	if (ret)
 		return ret;
-	oversampling_ratio = ratio;
 	return count;
 }
 
@@ -635,7 +1354,11 @@ static ssize_t hdaps_running_avg_filter_order_show(
 	struct device *dev, struct device_attribute *attr, char *buf)
 {
 	int rate, order;
-	int ret = hdaps_get_ec_config(&rate, &order);
+	int ret;
+
+	if (!hdaps_sensor_on()) /* EC isn't sampling */
+		return sprintf(buf, "%u\n", running_avg_filter_order);
+	ret = hdaps_get_ec_config(&rate, &order);
 	if (ret)
 		return ret;
 	return sprintf(buf, "%u\n", order);
@@ -646,34 +1369,139 @@ static ssize_t hdaps_running_avg_filter_order_store(
 	const char *buf, size_t count)
 {
 	int order, ret;
-	if (sscanf(buf, "%d", &order) != 1)
+	if (sscanf(buf, "%d", &order) != 1 || order < 1 || order > 8)
 		return -EINVAL;
-	ret = hdaps_set_ec_config(sampling_rate*oversampling_ratio, order);
+	mutex_lock(&hdaps_users_mtx);
+	ret = hdaps_sensor_on() ? /* else applied at power-up */
+	      hdaps_set_ec_config_locked(hdaps_rate*oversampling_ratio,
+					 order) : 0;
+	if (!ret)
+		running_avg_filter_order = order;
+	mutex_unlock(&hdaps_users_mtx);
 	if (ret)
 		return ret;
-	running_avg_filter_order = order;
 	return count;
 }
 
-static int hdaps_mousedev_open(struct input_dev *dev)
+static ssize_t hdaps_filter_show(
+	struct device *dev, struct device_attribute *attr, char *buf)
 {
-	if (!try_module_get(THIS_MODULE))
-		return -ENODEV;
+	ssize_t len = 0;
+	int i, ret;
+
+	ret = thinkpad_ec_lock();
+	if (ret)
+		return ret;
+	for (i = 0; i < hdaps_nfilters; ++i)
+		len += sprintf(buf + len, "%s%s %d", i ? " " : "",
+			       hdaps_filter_names[hdaps_filters[i].type],
+			       hdaps_filters[i].param);
+	thinkpad_ec_unlock();
+	if (!len)
+		len = sprintf(buf, "none");
+	buf[len++] = '\n';
+	return len;
+}
+
+/* Parse "<type> <param> ...", e.g. "median 5 lowpass 3", or "none" */
+static ssize_t hdaps_filter_store(
+	struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	struct hdaps_filter chain[HDAPS_FILTER_STAGES];
+	char name[16];
+	const char *p = skip_spaces(buf);
+	int n, type, param, len, ret;
+
+	memset(chain, 0, sizeof(chain));
+	if (sysfs_streq(p, "none"))
+		p += strlen(p);
+	for (n = 0; *p; p = skip_spaces(p + len), ++n) {
+		if (n == HDAPS_FILTER_STAGES ||
+		    sscanf(p, "%15s %d%n", name, &param, &len) != 2)
+			return -EINVAL;
+		for (type = 0; type < ARRAY_SIZE(hdaps_filter_names); ++type)
+			if (!strcmp(name, hdaps_filter_names[type]))
+				break;
+		if (type == ARRAY_SIZE(hdaps_filter_names))
+			return -EINVAL;
+		if (type == HDAPS_FILTER_MEDIAN ?
+		    param < 3 || param > HDAPS_MEDIAN_MAX || !(param & 1) :
+		    param < 1 || param > 8)
+			return -EINVAL;
+		chain[n].type = type;
+		chain[n].param = param;
+	}
+
+	ret = thinkpad_ec_lock();
+	if (ret)
+		return ret;
+	memcpy(hdaps_filters, chain, sizeof(chain));
+	hdaps_nfilters = n;
+	thinkpad_ec_unlock();
+	return count;
+}
+
+static ssize_t hdaps_missed_deadlines_show(
+	struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", missed_deadlines);
+}
+
+static ssize_t hdaps_overruns_show(
+	struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", overruns);
+}
+
+/* Sampler users: the sampler runs while there is at least one, at the
+ * rate they need.
+ */
+static int hdaps_user_get(void)
+{
+	int ret = 0;
 
 	mutex_lock(&hdaps_users_mtx);
-	if (hdaps_users++ == 0) /* first input user */
-		mod_timer(&hdaps_timer, jiffies + HZ/sampling_rate);
+	if (!hdaps_resuming) { /* else hdaps_resume_init() starts sampling */
+		ret = hdaps_power_up();
+		if (ret)
+			goto out;
+	}
+	hdaps_users++;
+	hdaps_retune(); /* on failure, keep the current rate */
+	/* First user, or the sampler was lost to a failed resume */
+	if (!hdaps_resuming)
+		hdaps_sampler_start(); /* no-op if already running */
+out:
 	mutex_unlock(&hdaps_users_mtx);
-	return 0;
+	return ret;
 }
 
-static void hdaps_mousedev_close(struct input_dev *dev)
+static void hdaps_user_put(void)
 {
 	mutex_lock(&hdaps_users_mtx);
-	if (--hdaps_users == 0) /* no input users left */
-		del_timer_sync(&hdaps_timer);
+	if (--hdaps_users == 0) /* no users left */
+		hdaps_sampler_stop();
+	hdaps_retune();
+	hdaps_idle_arm();
 	mutex_unlock(&hdaps_users_mtx);
+}
+
+static int hdaps_mousedev_open(struct input_dev *dev)
+{
+	int ret;
+
+	if (!try_module_get(THIS_MODULE))
+		return -ENODEV;
+	ret = hdaps_user_get();
+	if (ret)
+		module_put(THIS_MODULE);
+	return ret;
+}
 
+static void hdaps_mousedev_close(struct input_dev *dev)
+{
+	hdaps_user_put();
 	module_put(THIS_MODULE);
 }
 
@@ -683,6 +1511,8 @@ static DEVICE_ATTR(temp1, 0444, hdaps_temp1_show, NULL);
 static DEVICE_ATTR(keyboard_activity, 0444,
 		   hdaps_keyboard_activity_show, NULL);
 static DEVICE_ATTR(mouse_activity, 0444, hdaps_mouse_activity_show, NULL);
+static DEVICE_ATTR(sample_age_us, 0444, hdaps_sample_age_us_show, NULL);
+static DEVICE_ATTR(sample_seq, 0444, hdaps_sample_seq_show, NULL);
 static DEVICE_ATTR(calibrate, 0644,
 		   hdaps_calibrate_show, hdaps_calibrate_store);
 static DEVICE_ATTR(invert, 0644, hdaps_invert_show, hdaps_invert_store);
@@ -694,17 +1524,38 @@ static DEVICE_ATTR(oversampling_ratio, 0644,
 static DEVICE_ATTR(running_avg_filter_order, 0644,
 		   hdaps_running_avg_filter_order_show,
 		   hdaps_running_avg_filter_order_store);
+static DEVICE_ATTR(filter, 0644, hdaps_filter_show, hdaps_filter_store);
+static DEVICE_ATTR(missed_deadlines, 0444, hdaps_missed_deadlines_show, NULL);
+static DEVICE_ATTR(overruns, 0444, hdaps_overruns_show, NULL);
+
+static ssize_t hdaps_freefall_disk_show(struct device *dev,
+				struct device_attribute *attr, char *buf);
+static ssize_t hdaps_freefall_disk_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count);
+static ssize_t hdaps_freefall_stats_show(struct device *dev,
+				struct device_attribute *attr, char *buf);
+static DEVICE_ATTR(freefall_disk, 0644,
+	hdaps_freefall_disk_show, hdaps_freefall_disk_store);
+static DEVICE_ATTR(freefall_stats, 0444, hdaps_freefall_stats_show, NULL);
 
 static struct attribute *hdaps_attributes[] = {
 	&dev_attr_position.attr,
 	&dev_attr_temp1.attr,
 	&dev_attr_keyboard_activity.attr,
 	&dev_attr_mouse_activity.attr,
+	&dev_attr_sample_age_us.attr,
+	&dev_attr_sample_seq.attr,
 	&dev_attr_calibrate.attr,
 	&dev_attr_invert.attr,
 	&dev_attr_sampling_rate.attr,
 	&dev_attr_oversampling_ratio.attr,
 	&dev_attr_running_avg_filter_order.attr,
+	&dev_attr_filter.attr,
+	&dev_attr_missed_deadlines.attr,
+	&dev_attr_overruns.attr,
+	&dev_attr_freefall_disk.attr,
+	&dev_attr_freefall_stats.attr,
 	NULL,
 };
 
@@ -712,6 +1563,1044 @@ static struct attribute_group hdaps_attribute_group = {
 	.attrs = hdaps_attributes,
 };
 
+/* Stream device: /dev/hdaps delivers every sample, with its timestamp,
+ * through a per-open-file ring buffer. Readers choose a wakeup watermark
+ * so they can take samples in batches instead of one wakeup each.
+ */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,16,0)
+#define EPOLLIN		POLLIN
+#define EPOLLRDNORM	POLLRDNORM
+#define __poll_t	unsigned int
+#endif
+
+#define HDAPS_STREAM_LEN	HDAPS_MAX_WATERMARK /* records, power of 2 */
+#define HDAPS_READ_CHUNK	32	/* records copied per lock hold */
+
+struct hdaps_reader {
+	struct list_head list;
+	DECLARE_KFIFO(fifo, struct hdaps_event, HDAPS_STREAM_LEN);
+	wait_queue_head_t wait;
+	struct mutex read_mtx;	/* serializes readers of this file */
+	unsigned int watermark;
+	unsigned int flags;	/* HDAPS_STREAM_* */
+	unsigned long dropped;	/* oldest records overwritten */
+	/* decimation to the reader's own rate, if set: */
+	unsigned int rate;	/* Hz, or 0 for every readout */
+	s64 period_ns, next_ns;	/* record interval, next record due */
+	int sum_x, sum_y, nsum;	/* readouts since the last record */
+	u8 kmact;
+};
+
+static LIST_HEAD(hdaps_readers);
+static DEFINE_SPINLOCK(hdaps_readers_lock); /* list and all fifos */
+
+/* Highest rate asked for by any reader, and how many asked; 0 if none */
+static int hdaps_stream_max_rate(int *nrated)
+{
+	struct hdaps_reader *r;
+	int rate = 0;
+
+	*nrated = 0;
+	spin_lock(&hdaps_readers_lock);
+	list_for_each_entry(r, &hdaps_readers, list) {
+		if (!r->rate)
+			continue;
+		++*nrated;
+		rate = max_t(int, rate, r->rate);
+	}
+	spin_unlock(&hdaps_readers_lock);
+	return rate;
+}
+
+/**
+ * hdaps_stream_decimate - reduce a reader's readouts to its own rate
+ * Returns true if a record is due, and sets @out to it: the latest
+ * readout, or with HDAPS_STREAM_AVERAGE the mean of those since the last
+ * record. Caller must hold hdaps_readers_lock.
+ */
+static bool hdaps_stream_decimate(struct hdaps_reader *r,
+				  const struct hdaps_event *ev,
+				  struct hdaps_event *out)
+{
+	/* Readouts arrive with jitter; accept one up to half a period early */
+	s64 slack = NSEC_PER_SEC / (2 * hdaps_rate);
+
+	r->sum_x += ev->x;
+	r->sum_y += ev->y;
+	r->kmact |= ev->kmact;
+	++r->nsum;
+	if (ev->time_ns + slack < r->next_ns)
+		return false;
+
+	*out = *ev;
+	if (r->flags & HDAPS_STREAM_AVERAGE) {
+		out->x = r->sum_x / r->nsum;
+		out->y = r->sum_y / r->nsum;
+	}
+	out->kmact = r->kmact;
+	r->sum_x = r->sum_y = r->nsum = 0;
+	r->kmact = 0;
+
+	r->next_ns += r->period_ns;
+	if (r->next_ns <= ev->time_ns) /* after a gap, don't catch up */
+		r->next_ns = ev->time_ns + r->period_ns;
+	return true;
+}
+
+static void hdaps_stream_push(const struct hdaps_sample *sample)
+{
+	struct hdaps_reader *r;
+	struct hdaps_event ev = {
+		.time_ns = ktime_to_ns(sample->time),
+		.x = sample->x,
+		.y = sample->y,
+		.temp = sample->temp,
+		.kmact = sample->kmact,
+	};
+	struct hdaps_event fev = ev, dec;
+	const struct hdaps_event *out;
+
+	fev.x = clamp_t(int, sample->fx, S16_MIN, S16_MAX);
+	fev.y = clamp_t(int, sample->fy, S16_MIN, S16_MAX);
+
+	spin_lock(&hdaps_readers_lock);
+	list_for_each_entry(r, &hdaps_readers, list) {
+		out = (r->flags & HDAPS_STREAM_FILTERED) ? &fev : &ev;
+		if (r->rate) {
+			if (!hdaps_stream_decimate(r, out, &dec))
+				continue;
+			out = &dec;
+		}
+		if (kfifo_is_full(&r->fifo)) { /* keep the newest */
+			kfifo_skip(&r->fifo);
+			++r->dropped;
+		}
+		kfifo_put(&r->fifo, *out);
+		if (kfifo_len(&r->fifo) >= r->watermark)
+			wake_up_interruptible(&r->wait);
+	}
+	spin_unlock(&hdaps_readers_lock);
+}
+
+static unsigned int hdaps_stream_avail(struct hdaps_reader *r)
+{
+	unsigned int len;
+	spin_lock(&hdaps_readers_lock);
+	len = kfifo_len(&r->fifo);
+	spin_unlock(&hdaps_readers_lock);
+	return len;
+}
+
+static int hdaps_stream_open(struct inode *inode, struct file *file)
+{
+	struct hdaps_reader *r = kzalloc(sizeof(*r), GFP_KERNEL);
+	int ret;
+
+	if (!r)
+		return -ENOMEM;
+	INIT_KFIFO(r->fifo);
+	init_waitqueue_head(&r->wait);
+	mutex_init(&r->read_mtx);
+	r->watermark = 1;
+	file->private_data = r;
+
+	spin_lock(&hdaps_readers_lock);
+	list_add_tail(&r->list, &hdaps_readers);
+	spin_unlock(&hdaps_readers_lock);
+	ret = hdaps_user_get();
+	if (ret) {
+		spin_lock(&hdaps_readers_lock);
+		list_del(&r->list);
+		spin_unlock(&hdaps_readers_lock);
+		kfree(r);
+		return ret;
+	}
+	return nonseekable_open(inode, file);
+}
+
+static int hdaps_stream_release(struct inode *inode, struct file *file)
+{
+	struct hdaps_reader *r = file->private_data;
+
+	spin_lock(&hdaps_readers_lock);
+	list_del(&r->list);
+	spin_unlock(&hdaps_readers_lock);
+	hdaps_user_put(); /* after list_del, so its rate no longer counts */
+	kfree(r);
+	return 0;
+}
+
+static ssize_t hdaps_stream_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct hdaps_reader *r = file->private_data;
+	struct hdaps_event chunk[HDAPS_READ_CHUNK];
+	unsigned int want = min_t(size_t, count / sizeof(*chunk),
+				  HDAPS_STREAM_LEN);
+	unsigned int n;
+	ssize_t done = 0;
+	int ret;
+
+	if (want == 0)
+		return -EINVAL;
+	want = min(want, r->watermark);
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (!hdaps_stream_avail(r))
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(r->wait,
+					hdaps_stream_avail(r) >= want);
+		if (ret)
+			return ret;
+	}
+
+	mutex_lock(&r->read_mtx);
+	while (count - done >= sizeof(*chunk)) {
+		n = min_t(size_t, (count - done) / sizeof(*chunk),
+			  HDAPS_READ_CHUNK);
+		n = kfifo_out_spinlocked(&r->fifo, chunk, n,
+					 &hdaps_readers_lock);
+		if (!n)
+			break;
+		if (copy_to_user(buf + done, chunk, n * sizeof(*chunk))) {
+			done = done ? done : -EFAULT;
+			break;
+		}
+		done += n * sizeof(*chunk);
+	}
+	mutex_unlock(&r->read_mtx);
+	return done;
+}
+
+static __poll_t hdaps_stream_poll(struct file *file, poll_table *wait)
+{
+	struct hdaps_reader *r = file->private_data;
+
+	poll_wait(file, &r->wait, wait);
+	if (hdaps_stream_avail(r) >= r->watermark)
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+static long hdaps_stream_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct hdaps_reader *r = file->private_data;
+	u32 __user *argp = (u32 __user *)arg;
+	u32 val;
+	int ret;
+
+	switch (cmd) {
+	case HDAPS_IOC_SET_WATERMARK:
+		if (get_user(val, argp))
+			return -EFAULT;
+		if (val < 1 || val > HDAPS_MAX_WATERMARK)
+			return -EINVAL;
+		r->watermark = val;
+		wake_up_interruptible(&r->wait); /* may be satisfied now */
+		return 0;
+	case HDAPS_IOC_GET_WATERMARK:
+		return put_user(r->watermark, argp);
+	case HDAPS_IOC_SET_FLAGS:
+		if (get_user(val, argp))
+			return -EFAULT;
+		if (val & ~(HDAPS_STREAM_FILTERED | HDAPS_STREAM_AVERAGE))
+			return -EINVAL;
+		spin_lock(&hdaps_readers_lock);
+		r->flags = val;
+		spin_unlock(&hdaps_readers_lock);
+		return 0;
+	case HDAPS_IOC_GET_FLAGS:
+		return put_user(r->flags, argp);
+	case HDAPS_IOC_SET_RATE:
+		if (get_user(val, argp))
+			return -EFAULT;
+		if (val > HDAPS_MAX_RATE)
+			return -EINVAL;
+		spin_lock(&hdaps_readers_lock);
+		r->rate = val;
+		r->period_ns = val ? NSEC_PER_SEC / val : 0;
+		r->next_ns = 0;
+		r->sum_x = r->sum_y = r->nsum = 0;
+		r->kmact = 0;
+		spin_unlock(&hdaps_readers_lock);
+		mutex_lock(&hdaps_users_mtx);
+		ret = hdaps_retune();
+		mutex_unlock(&hdaps_users_mtx);
+		return ret;
+	case HDAPS_IOC_GET_RATE:
+		return put_user(r->rate, argp);
+	}
+	return -ENOTTY;
+}
+
+#if defined(CONFIG_COMPAT) && LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
+static long hdaps_stream_compat_ioctl(struct file *file, unsigned int cmd,
+				      unsigned long arg)
+{
+	return hdaps_stream_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static const struct file_operations hdaps_stream_fops = {
+	.owner = THIS_MODULE,
+	.open = hdaps_stream_open,
+	.release = hdaps_stream_release,
+	.read = hdaps_stream_read,
+	.poll = hdaps_stream_poll,
+	.unlocked_ioctl = hdaps_stream_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+	.compat_ioctl = compat_ptr_ioctl,
+#elif defined(CONFIG_COMPAT)
+	.compat_ioctl = hdaps_stream_compat_ioctl,
+#endif
+};
+
+static struct miscdevice hdaps_stream_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "hdaps",
+	.fops = &hdaps_stream_fops,
+};
+
+
+/* Free-fall detector: watches every sample and unloads the disk heads
+ * itself, instead of waiting for a userspace daemon to be scheduled.
+ * It triggers when the position jumps by at least freefall_delta between
+ * consecutive samples, or when the variance of the last freefall_window
+ * samples reaches freefall_variance (both summed over the two axes, in
+ * raw sensor units; 0 disables a test). After a trigger, further ones are
+ * ignored for freefall_cooldown_ms. The heads are unloaded only while a
+ * disk is set in freefall_disk, and kept unloaded for freefall_park_ms.
+ * Test streams written to debugfs run through a detector of their own.
+ */
+
+#define HDAPS_FF_MAX_WINDOW	16		/* power of 2 */
+#define HDAPS_FF_MAX_PARK_MS	30000		/* libata's limit */
+
+static unsigned int freefall_delta = 60;
+static unsigned int freefall_variance = 600;
+static unsigned int freefall_window = 8;
+static unsigned int freefall_cooldown_ms = 3000;
+static unsigned int freefall_park_ms = 3000;
+
+struct hdaps_ff_disk {
+	unsigned int host, channel, id;
+	u64 lun;
+};
+
+struct hdaps_ff_state {
+	int x[HDAPS_FF_MAX_WINDOW], y[HDAPS_FF_MAX_WINDOW];
+	unsigned int pos, count;	/* ring position and fill level */
+	ktime_t quiet_until;		/* end of cooldown */
+	ktime_t detected;		/* time of the last trigger */
+	/* statistics: */
+	unsigned long triggers, suppressed, parks, errors;
+	s64 lat_last, lat_min, lat_max, lat_total; /* detection to park, ns */
+};
+
+static struct hdaps_ff_state ff;	/* fed by the sampler */
+static struct hdaps_ff_state ff_inject;	/* fed by debugfs freefall_inject */
+static DEFINE_SPINLOCK(ff_lock); /* protects ff and ff_inject */
+
+static struct hdaps_ff_disk ff_disk;
+static bool ff_armed;		/* ff_disk is set, and counts as a user */
+static DEFINE_MUTEX(ff_disk_mtx); /* protects ff_disk and ff_armed */
+
+static bool ff_inject_unload;	/* injected triggers unload the heads too */
+static DEFINE_MUTEX(ff_inject_mtx); /* one injected stream at a time */
+
+static void hdaps_ff_park(struct work_struct *work);
+static DECLARE_WORK(ff_park_work, hdaps_ff_park);
+static DECLARE_WORK(ff_inject_park_work, hdaps_ff_park);
+
+/**
+ * hdaps_ff_check - add a sample to the detector history and test it
+ * Caller must hold ff_lock. Returns true if the sample triggers.
+ */
+static bool hdaps_ff_check(struct hdaps_ff_state *st, int x, int y)
+{
+	const unsigned int mask = HDAPS_FF_MAX_WINDOW - 1;
+	unsigned int n = clamp_t(unsigned int, freefall_window, 2,
+				 HDAPS_FF_MAX_WINDOW);
+	unsigned int delta = 0, i, k;
+	s64 sx = 0, sy = 0, sxx = 0, syy = 0;
+	u64 var;
+
+	if (st->count) {
+		k = (st->pos - 1) & mask;
+		delta = abs(x - st->x[k]) + abs(y - st->y[k]);
+	}
+	st->x[st->pos] = x;
+	st->y[st->pos] = y;
+	st->pos = (st->pos + 1) & mask;
+	if (st->count < HDAPS_FF_MAX_WINDOW)
+		++st->count;
+
+	if (freefall_delta && delta >= freefall_delta)
+		return true;
+	if (!freefall_variance || st->count < n)
+		return false;
+
+	for (i = 0; i < n; ++i) {
+		k = (st->pos - 1 - i) & mask;
+		sx += st->x[k];
+		sxx += (s64)st->x[k] * st->x[k];
+		sy += st->y[k];
+		syy += (s64)st->y[k] * st->y[k];
+	}
+	/* n^2 times the population variance, computed without fractions */
+	var = (n * sxx - sx * sx) + (n * syy - sy * sy);
+	return div_u64(var, n * n) >= freefall_variance;
+}
+
+/* Forget the sample history, e.g. when sampling restarts */
+static void hdaps_ff_reset(void)
+{
+	spin_lock(&ff_lock);
+	ff.pos = ff.count = 0;
+	spin_unlock(&ff_lock);
+}
+
+/**
+ * hdaps_ff_detect - run a sample through a detector
+ * Caller must hold ff_lock. Returns true if the sample triggers outside
+ * the cooldown, i.e. the heads should be unloaded.
+ */
+static bool hdaps_ff_detect(struct hdaps_ff_state *st, int x, int y)
+{
+	ktime_t now;
+
+	if (!hdaps_ff_check(st, x, y))
+		return false;
+	now = ktime_get();
+	++st->triggers;
+	if (ktime_before(now, st->quiet_until)) {
+		++st->suppressed;
+		return false;
+	}
+	st->quiet_until = ktime_add_ms(now, freefall_cooldown_ms);
+	st->detected = now;
+	return true;
+}
+
+static void hdaps_ff_feed(const struct hdaps_sample *sample)
+{
+	spin_lock(&ff_lock);
+	if (hdaps_ff_detect(&ff, sample->x, sample->y) && READ_ONCE(ff_armed))
+		queue_work(system_highpri_wq, &ff_park_work);
+	spin_unlock(&ff_lock);
+}
+
+#if IS_REACHABLE(CONFIG_ATA)
+/* Is the disk's host driven by libata, i.e. does it have unload_heads? */
+static bool hdaps_ff_libata(struct scsi_device *sdev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+	const struct attribute_group **g = sdev->host->hostt->sdev_groups;
+	struct attribute **a;
+
+	for (; g && *g; ++g)
+		for (a = (*g)->attrs; a && *a; ++a)
+			if (*a == &dev_attr_unload_heads.attr)
+				return true;
+#else
+	struct device_attribute **a = sdev->host->hostt->sdev_attrs;
+
+	for (; a && *a; ++a)
+		if (*a == &dev_attr_unload_heads)
+			return true;
+#endif
+	return false;
+}
+
+/**
+ * hdaps_ff_unload - unload the heads of an ATA disk
+ * Goes through libata's unload_heads attribute, like hdapsd: libata's
+ * error handler unloads the heads and keeps the port frozen for @ms, so
+ * that queued I/O doesn't reload them in mid-fall. This only schedules
+ * the unload. Caller must hold ff_disk_mtx.
+ */
+static int hdaps_ff_unload(const struct hdaps_ff_disk *disk, unsigned int ms)
+{
+	struct Scsi_Host *shost;
+	struct scsi_device *sdev;
+	char buf[16];
+	int ret;
+
+	shost = scsi_host_lookup(disk->host);
+	if (IS_ERR_OR_NULL(shost))
+		return -ENODEV;
+	sdev = scsi_device_lookup(shost, disk->channel, disk->id, disk->lun);
+	if (!sdev) {
+		ret = -ENODEV;
+		goto out_host;
+	}
+	if (hdaps_ff_libata(sdev)) {
+		snprintf(buf, sizeof(buf), "%u",
+			 clamp_t(unsigned int, ms, 1, HDAPS_FF_MAX_PARK_MS));
+		ret = dev_attr_unload_heads.store(&sdev->sdev_gendev,
+						  &dev_attr_unload_heads,
+						  buf, strlen(buf));
+		if (ret > 0)
+			ret = 0;
+	} else {
+		ret = -EOPNOTSUPP; /* not an ATA disk on libata */
+	}
+	scsi_device_put(sdev);
+out_host:
+	scsi_host_put(shost);
+	return ret;
+}
+#else
+static int hdaps_ff_unload(const struct hdaps_ff_disk *disk, unsigned int ms)
+{
+	return -ENODEV;
+}
+#endif /* CONFIG_ATA */
+
+/* Unload the heads, and account it to the detector that triggered */
+static void hdaps_ff_park(struct work_struct *work)
+{
+	struct hdaps_ff_state *st = (work == &ff_park_work) ? &ff : &ff_inject;
+	ktime_t detected;
+	s64 lat;
+	int ret;
+
+	spin_lock(&ff_lock);
+	detected = st->detected;
+	spin_unlock(&ff_lock);
+
+	mutex_lock(&ff_disk_mtx);
+	ret = ff_armed ? hdaps_ff_unload(&ff_disk, freefall_park_ms) : -ENODEV;
+	mutex_unlock(&ff_disk_mtx);
+	lat = ktime_to_ns(ktime_sub(ktime_get(), detected));
+
+	spin_lock(&ff_lock);
+	if (ret) {
+		++st->errors;
+	} else {
+		if (!st->parks || lat < st->lat_min)
+			st->lat_min = lat;
+		if (lat > st->lat_max)
+			st->lat_max = lat;
+		st->lat_last = lat;
+		st->lat_total += lat;
+		++st->parks;
+	}
+	spin_unlock(&ff_lock);
+
+	if (ret)
+		printk_ratelimited(KERN_ERR "hdaps: head unload failed "
+				   "(ret=%d)\n", ret);
+}
+
+static ssize_t hdaps_freefall_disk_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&ff_disk_mtx);
+	if (ff_armed)
+		ret = sprintf(buf, "%u:%u:%u:%llu\n", ff_disk.host,
+			      ff_disk.channel, ff_disk.id,
+			      (unsigned long long)ff_disk.lun);
+	else
+		ret = sprintf(buf, "none\n");
+	mutex_unlock(&ff_disk_mtx);
+	return ret;
+}
+
+static ssize_t hdaps_freefall_disk_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct hdaps_ff_disk disk;
+	unsigned long long lun;
+	bool arm = true;
+	int ret = 0;
+
+	if (sysfs_streq(buf, "") || sysfs_streq(buf, "none"))
+		arm = false;
+	else if (sscanf(buf, "%u:%u:%u:%llu", &disk.host, &disk.channel,
+			&disk.id, &lun) == 4)
+		disk.lun = lun;
+	else
+		return -EINVAL;
+
+	mutex_lock(&ff_disk_mtx);
+	if (arm != ff_armed) { /* the detector needs the sampler running */
+		if (arm)
+			ret = hdaps_user_get();
+		else
+			hdaps_user_put();
+	}
+	if (!ret) {
+		if (arm)
+			ff_disk = disk;
+		WRITE_ONCE(ff_armed, arm);
+	}
+	mutex_unlock(&ff_disk_mtx);
+	if (ret)
+		return ret;
+	return count;
+}
+
+/* Format a detector's statistics, as shown in freefall_stats */
+static int hdaps_ff_stats_print(struct hdaps_ff_state *st, char *buf,
+				size_t size)
+{
+	unsigned long triggers, suppressed, parks, errors;
+	s64 last, min, max, avg;
+
+	spin_lock(&ff_lock);
+	triggers = st->triggers;
+	suppressed = st->suppressed;
+	parks = st->parks;
+	errors = st->errors;
+	last = st->lat_last;
+	min = st->lat_min;
+	max = st->lat_max;
+	avg = parks ? div64_s64(st->lat_total, parks) : 0;
+	spin_unlock(&ff_lock);
+
+	return scnprintf(buf, size, "%lu %lu %lu %lu %lld %lld %lld %lld\n",
+		       triggers, suppressed, parks, errors,
+		       div_s64(last, NSEC_PER_USEC), div_s64(min, NSEC_PER_USEC),
+		       div_s64(avg, NSEC_PER_USEC), div_s64(max, NSEC_PER_USEC));
+}
+
+static ssize_t hdaps_freefall_stats_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return hdaps_ff_stats_print(&ff, buf, PAGE_SIZE);
+}
+
+/* debugfs freefall_inject: writing "x y" pairs feeds them to a separate
+ * detector as a fresh stream (its history is cleared first), for testing
+ * the thresholds without dropping the machine. Reading it gives that
+ * detector's statistics. Its triggers only unload the heads if
+ * freefall_inject_unload is set (and freefall_disk is). */
+static ssize_t hdaps_ff_inject_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	ssize_t ret = count;
+	char *buf, *p;
+	int x, y, len;
+	bool trig;
+
+	if (count > PAGE_SIZE)
+		return -E2BIG;
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	mutex_lock(&ff_inject_mtx);
+	spin_lock(&ff_lock);
+	ff_inject.pos = ff_inject.count = 0;
+	spin_unlock(&ff_lock);
+	for (p = skip_spaces(buf); *p; p = skip_spaces(p + len)) {
+		if (sscanf(p, "%d %d%n", &x, &y, &len) != 2) {
+			ret = -EINVAL;
+			break;
+		}
+		spin_lock(&ff_lock);
+		trig = hdaps_ff_detect(&ff_inject, x, y);
+		spin_unlock(&ff_lock);
+		if (trig && READ_ONCE(ff_inject_unload) && READ_ONCE(ff_armed))
+			queue_work(system_highpri_wq, &ff_inject_park_work);
+	}
+	mutex_unlock(&ff_inject_mtx);
+	kfree(buf);
+	return ret;
+}
+
+static ssize_t hdaps_ff_inject_read(struct file *file, char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	char buf[128];
+	int len = hdaps_ff_stats_print(&ff_inject, buf, sizeof(buf));
+
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static const struct file_operations hdaps_ff_inject_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = hdaps_ff_inject_read,
+	.write = hdaps_ff_inject_write,
+	.llseek = default_llseek,
+};
+
+/* Call after the sysfs and debugfs files are gone, so nothing can re-arm */
+static void hdaps_ff_exit(void)
+{
+	mutex_lock(&ff_disk_mtx);
+	if (ff_armed) {
+		hdaps_user_put(); /* stops the sampler: no new triggers */
+		ff_armed = false;
+	}
+	mutex_unlock(&ff_disk_mtx);
+	cancel_work_sync(&ff_park_work);
+	cancel_work_sync(&ff_inject_park_work);
+}
+
+
+/* debugfs, under /sys/kernel/debug/hdaps/ */
+
+static struct dentry *hdaps_debugfs_dir;
+
+static int hdaps_bench_show(struct seq_file *m, void *v)
+{
+	typeof(bench) b;
+	s64 elapsed;
+	unsigned int i;
+	int ret;
+
+	ret = thinkpad_ec_lock(); /* for a consistent snapshot */
+	if (ret)
+		return ret;
+	b = bench;
+	thinkpad_ec_unlock();
+	elapsed = b.on ? ktime_to_ns(ktime_sub(ktime_get(), b.started)) : 0;
+
+	seq_printf(m, "running:\t%d\n", b.on);
+	seq_printf(m, "elapsed_ms:\t%lld\n", div_s64(elapsed, NSEC_PER_MSEC));
+	seq_printf(m, "rate:\t\t%d\n", hdaps_rate);
+	seq_printf(m, "ticks:\t\t%lu\n", b.ticks);
+	seq_printf(m, "lock_busy:\t%lu\n", b.lock_busy);
+	seq_printf(m, "ec_busy:\t%lu\n", b.ec_busy);
+	seq_printf(m, "not_prefetched:\t%lu\n", b.not_prefetched);
+	seq_printf(m, "no_readouts:\t%lu\n", b.no_readouts);
+	seq_printf(m, "late_avg_us:\t%lld\n", b.ticks ?
+		   div_s64(div_s64(b.late_sum, b.ticks),
+			   NSEC_PER_USEC) : 0);
+	seq_printf(m, "late_max_us:\t%lld\n",
+		   div_s64(b.late_max, NSEC_PER_USEC));
+	seq_printf(m, "intervals:\t%lu\n", b.intervals);
+	seq_printf(m, "interval_us:\t%lld %lld %lld (min avg max)\n",
+		   div_s64(b.interval_min, NSEC_PER_USEC),
+		   b.intervals ? div_s64(div_s64(b.interval_sum,
+			   b.intervals), NSEC_PER_USEC) : 0,
+		   div_s64(b.interval_max, NSEC_PER_USEC));
+	seq_puts(m, "interval_pct_of_period:\n");
+	for (i = 0; i < HDAPS_BENCH_BINS; ++i) {
+		if (i < HDAPS_BENCH_BINS - 1)
+			seq_printf(m, "  <%u%%:\t%lu\n", hdaps_bench_edges[i],
+				   b.interval_hist[i]);
+		else
+			seq_printf(m, "  >=%u%%:\t%lu\n", hdaps_bench_edges[i-1],
+				   b.interval_hist[i]);
+	}
+	seq_puts(m, "queue_depth:");
+	for (i = 0; i < HDAPS_BENCH_DEPTHS; ++i)
+		seq_printf(m, " %lu", b.depth[i]);
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static int hdaps_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hdaps_bench_show, NULL);
+}
+
+/* Writing 1 resets the counters and starts measuring, 0 stops */
+static ssize_t hdaps_bench_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	bool on;
+	int ret = kstrtobool_from_user(ubuf, count, &on);
+
+	if (ret)
+		return ret;
+	ret = thinkpad_ec_lock(); /* keep hdaps_read_readouts() out */
+	if (ret)
+		return ret;
+	if (on) {
+		memset(&bench, 0, sizeof(bench));
+		bench.started = ktime_get();
+	}
+	bench.on = on;
+	thinkpad_ec_unlock();
+	return count;
+}
+
+static const struct file_operations hdaps_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = hdaps_bench_open,
+	.read = seq_read,
+	.write = hdaps_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void __init hdaps_debugfs_init(void)
+{
+	hdaps_debugfs_dir = debugfs_create_dir("hdaps", NULL);
+	if (IS_ERR_OR_NULL(hdaps_debugfs_dir))
+		return;
+	debugfs_create_file("freefall_inject", 0600, hdaps_debugfs_dir, NULL,
+			    &hdaps_ff_inject_fops);
+	debugfs_create_bool("freefall_inject_unload", 0600, hdaps_debugfs_dir,
+			    &ff_inject_unload);
+	debugfs_create_file("benchmark", 0600, hdaps_debugfs_dir, NULL,
+			    &hdaps_bench_fops);
+}
+
+static void hdaps_debugfs_exit(void)
+{
+	debugfs_remove_recursive(hdaps_debugfs_dir);
+	hdaps_debugfs_dir = NULL;
+}
+
+
+/* hwmon device, so lm-sensors and friends see the sensor temperature.
+ * Scrapers may poll aggressively, so serve recent readouts from memory.
+ */
+#if IS_REACHABLE(CONFIG_HWMON) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+
+static struct device *hdaps_hwmon_dev;
+
+static umode_t hdaps_hwmon_is_visible(const void *data,
+				      enum hwmon_sensor_types type,
+				      u32 attr, int channel)
+{
+	return 0444;
+}
+
+static int hdaps_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+			    u32 attr, int channel, long *val)
+{
+	if (last_update_jiffies == INITIAL_JIFFIES ||
+	    get_jiffies_64() > last_update_jiffies + HWMON_CACHE_PERIOD) {
+		int ret = hdaps_update();
+		if (ret)
+			return ret;
+	}
+	*val = temperature * 1000; /* units: millicelsius */
+	return 0;
+}
+
+static const u32 hdaps_hwmon_temp_config[] = { HWMON_T_INPUT, 0 };
+static const struct hwmon_channel_info hdaps_hwmon_temp = {
+	.type = hwmon_temp, .config = hdaps_hwmon_temp_config };
+static const struct hwmon_channel_info *hdaps_hwmon_info[] = {
+	&hdaps_hwmon_temp,
+	NULL
+};
+
+static const struct hwmon_ops hdaps_hwmon_ops = {
+	.is_visible = hdaps_hwmon_is_visible,
+	.read = hdaps_hwmon_read,
+};
+
+static const struct hwmon_chip_info hdaps_hwmon_chip_info = {
+	.ops = &hdaps_hwmon_ops,
+	.info = hdaps_hwmon_info,
+};
+
+static void hdaps_hwmon_init(void)
+{
+	struct device *hwdev = hwmon_device_register_with_info(&pdev->dev,
+		"hdaps", NULL, &hdaps_hwmon_chip_info, NULL);
+	if (IS_ERR(hwdev))
+		printk(KERN_WARNING "hdaps: cannot register hwmon (ret=%ld)\n",
+		       PTR_ERR(hwdev));
+	else
+		hdaps_hwmon_dev = hwdev;
+}
+
+static void hdaps_hwmon_exit(void)
+{
+	if (hdaps_hwmon_dev)
+		hwmon_device_unregister(hdaps_hwmon_dev);
+	hdaps_hwmon_dev = NULL;
+}
+
+#else /* CONFIG_HWMON */
+
+static inline void hdaps_hwmon_init(void) {}
+static inline void hdaps_hwmon_exit(void) {}
+
+#endif /* CONFIG_HWMON */
+
+
+/* IIO device, for buffered capture with the standard IIO tooling. Buffer
+ * scans are taken on whatever trigger the user attaches (e.g., an
+ * iio-trig-hrtimer instance), reading the EC unless the latest readout is
+ * still current. sampling_frequency is the EC sampling rate.
+ */
+#if IS_REACHABLE(CONFIG_IIO_TRIGGERED_BUFFER) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+
+enum { HDAPS_SCAN_X, HDAPS_SCAN_Y, HDAPS_SCAN_TEMP, HDAPS_SCAN_TIMESTAMP };
+
+#define HDAPS_IIO_ACCEL(axis) {						\
+	.type = IIO_ACCEL,						\
+	.modified = 1,							\
+	.channel2 = IIO_MOD_##axis,					\
+	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),			\
+	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE),		\
+	.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),	\
+	.scan_index = HDAPS_SCAN_##axis,				\
+	.scan_type = {							\
+		.sign = 's',						\
+		.realbits = 16,						\
+		.storagebits = 16,					\
+		.endianness = IIO_CPU,					\
+	},								\
+}
+
+static const struct iio_chan_spec hdaps_iio_channels[] = {
+	HDAPS_IIO_ACCEL(X),
+	HDAPS_IIO_ACCEL(Y),
+	{
+		.type = IIO_TEMP,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) |
+				      BIT(IIO_CHAN_INFO_SCALE),
+		.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),
+		.scan_index = HDAPS_SCAN_TEMP,
+		.scan_type = {
+			.sign = 'u',
+			.realbits = 8,
+			.storagebits = 8,
+		},
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(HDAPS_SCAN_TIMESTAMP),
+};
+
+static struct iio_dev *hdaps_iio_dev;
+
+static int hdaps_iio_read_raw(struct iio_dev *indio_dev,
+			      struct iio_chan_spec const *chan,
+			      int *val, int *val2, long mask)
+{
+	int ret;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		ret = hdaps_update();
+		if (ret)
+			return ret;
+		if (chan->type == IIO_TEMP)
+			*val = temperature;
+		else if (chan->channel2 == IIO_MOD_X)
+			*val = pos_x;
+		else
+			*val = pos_y;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		if (chan->type == IIO_TEMP) {
+			*val = 1000; /* units: millicelsius */
+			return IIO_VAL_INT;
+		}
+		*val = 980665; /* standard gravity, m/s^2 * 10^5 */
+		*val2 = 100000 * max(counts_per_g, 1U);
+		return IIO_VAL_FRACTIONAL;
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		*val = hdaps_rate;
+		return IIO_VAL_INT;
+	}
+	return -EINVAL;
+}
+
+static int hdaps_iio_write_raw(struct iio_dev *indio_dev,
+			       struct iio_chan_spec const *chan,
+			       int val, int val2, long mask)
+{
+	if (mask != IIO_CHAN_INFO_SAMP_FREQ || val2)
+		return -EINVAL;
+	return hdaps_set_sampling_rate(val);
+}
+
+static const struct iio_info hdaps_iio_info = {
+	.read_raw = hdaps_iio_read_raw,
+	.write_raw = hdaps_iio_write_raw,
+};
+
+static irqreturn_t hdaps_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct {
+		s16 accel[2];
+		u8 temp;
+		s64 timestamp __aligned(8);
+	} scan;
+
+	memset(&scan, 0, sizeof(scan));
+	if (!hdaps_update()) {
+		scan.accel[0] = pos_x;
+		scan.accel[1] = pos_y;
+		scan.temp = temperature;
+		/* The readout's capture time, on the device's IIO clock */
+		iio_push_to_buffers_with_timestamp(indio_dev, &scan,
+			ktime_to_ns(pos_time) +
+			(iio_get_time_ns(indio_dev) - ktime_get_ns()));
+	}
+	iio_trigger_notify_done(indio_dev->trig);
+	return IRQ_HANDLED;
+}
+
+static void hdaps_iio_init(void)
+{
+	struct iio_dev *indio_dev;
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+	indio_dev = iio_device_alloc(&pdev->dev, 0);
+#else
+	indio_dev = iio_device_alloc(0);
+	if (indio_dev)
+		indio_dev->dev.parent = &pdev->dev;
+#endif
+	if (!indio_dev) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	indio_dev->name = "hdaps";
+	indio_dev->info = &hdaps_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = hdaps_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(hdaps_iio_channels);
+
+	ret = iio_triggered_buffer_setup(indio_dev, NULL,
+					 hdaps_iio_trigger_handler, NULL);
+	if (ret)
+		goto out_free;
+	ret = iio_device_register(indio_dev);
+	if (ret)
+		goto out_buffer;
+	hdaps_iio_dev = indio_dev;
+	return;
+
+out_buffer:
+	iio_triggered_buffer_cleanup(indio_dev);
+out_free:
+	iio_device_free(indio_dev);
+out:
+	printk(KERN_WARNING "hdaps: cannot register IIO device (ret=%d)\n",
+	       ret);
+}
+
+static void hdaps_iio_exit(void)
+{
+	if (!hdaps_iio_dev)
+		return;
+	iio_device_unregister(hdaps_iio_dev);
+	iio_triggered_buffer_cleanup(hdaps_iio_dev);
+	iio_device_free(hdaps_iio_dev);
+	hdaps_iio_dev = NULL;
+}
+
+#else /* CONFIG_IIO_TRIGGERED_BUFFER */
+
+static inline void hdaps_iio_init(void) {}
+static inline void hdaps_iio_exit(void) {}
+
+#endif /* CONFIG_IIO_TRIGGERED_BUFFER */
+
 
 /* Module stuff */
 
@@ -782,13 +2671,6 @@ static int __init hdaps_init(void)
 		if (dmi_check_system(hdaps_whitelist) < 1) /* in whitelist? */
 			hdaps_invert = 0; /* default */
 
-	/* Init timer before platform_driver_register, in case of suspend */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-	init_timer(&hdaps_timer);
-	hdaps_timer.function = hdaps_mousedev_poll;
-#else
-	timer_setup(&hdaps_timer, hdaps_mousedev_poll, 0);
-#endif
 	ret = platform_driver_register(&hdaps_driver);
 	if (ret)
 		goto out;
@@ -860,9 +2742,21 @@ static int __init hdaps_init(void)
 	if (ret)
 		goto out_idev_reg_first;
 
+	ret = misc_register(&hdaps_stream_dev);
+	if (ret)
+		goto out_idev_reg_raw;
+
+	hdaps_hwmon_init();
+	hdaps_iio_init();
+	hdaps_debugfs_init();
+
 	printk(KERN_INFO "hdaps: driver successfully loaded.\n");
 	return 0;
 
+out_idev_reg_raw:
+	input_unregister_device(hdaps_idev_raw);
+	input_unregister_device(hdaps_idev);
+	goto out_group;
 out_idev_reg_first:
 	input_unregister_device(hdaps_idev);
 out_idev:
@@ -875,7 +2769,7 @@ out_device:
 	platform_device_unregister(pdev);
 out_driver:
 	platform_driver_unregister(&hdaps_driver);
-	hdaps_device_shutdown();
+	hdaps_power_exit();
 out:
 	printk(KERN_WARNING "hdaps: driver init failed (ret=%d)!\n", ret);
 	return ret;
@@ -883,10 +2777,15 @@ out:
 
 static void __exit hdaps_exit(void)
 {
+	hdaps_iio_exit();
+	hdaps_hwmon_exit();
+	misc_deregister(&hdaps_stream_dev);
 	input_unregister_device(hdaps_idev_raw);
 	input_unregister_device(hdaps_idev);
-	hdaps_device_shutdown(); /* ignore errors, effect is negligible */
 	sysfs_remove_group(&pdev->dev.kobj, &hdaps_attribute_group);
+	hdaps_debugfs_exit();
+	hdaps_ff_exit();
+	hdaps_power_exit();
 	platform_device_unregister(pdev);
 	platform_driver_unregister(&hdaps_driver);
 
@@ -899,6 +2798,34 @@ module_exit(hdaps_exit);
 module_param_named(invert, hdaps_invert, uint, 0);
 MODULE_PARM_DESC(invert, "axis orientation code");
 
+module_param_named(sampler_fifo, sampler_fifo, bool, 0644);
+MODULE_PARM_DESC(sampler_fifo, "run the sampler thread with SCHED_FIFO "
+		 "priority (applies when it next starts)");
+
+module_param(idle_timeout, uint, 0644);
+MODULE_PARM_DESC(idle_timeout, "power the sensor down after this many "
+		 "seconds without users or queries (0=never)");
+
+module_param(counts_per_g, uint, 0644);
+MODULE_PARM_DESC(counts_per_g, "accelerometer readout change for 1g, "
+		 "for the IIO scale (nominal 55)");
+
+module_param(freefall_delta, uint, 0644);
+MODULE_PARM_DESC(freefall_delta, "free-fall trigger: position change "
+		 "between samples (0=off)");
+module_param(freefall_variance, uint, 0644);
+MODULE_PARM_DESC(freefall_variance, "free-fall trigger: position variance "
+		 "over the window (0=off)");
+module_param(freefall_window, uint, 0644);
+MODULE_PARM_DESC(freefall_window, "free-fall variance window, in samples "
+		 "(2..16)");
+module_param(freefall_cooldown_ms, uint, 0644);
+MODULE_PARM_DESC(freefall_cooldown_ms, "ignore free-fall triggers for this "
+		 "long after one (ms)");
+module_param(freefall_park_ms, uint, 0644);
+MODULE_PARM_DESC(freefall_park_ms, "keep the heads unloaded and the disk's "
+		 "I/O on hold for this long after a trigger (ms, max 30000)");
+
 MODULE_AUTHOR("Robert Love");
 MODULE_DESCRIPTION("IBM Hard Drive Active Protection System (HDAPS) driver");
 MODULE_LICENSE("GPL v2");
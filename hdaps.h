@@ -0,0 +1,75 @@
+/*
+ *  hdaps.h - interface to the hdaps accelerometer stream device
+ *
+ *  This header is shared by the hdaps module and userspace readers of
+ *  /dev/hdaps.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _HDAPS_H
+#define _HDAPS_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * read() on /dev/hdaps returns whole records of this type, one per
+ * accelerometer readout, oldest first.
+ */
+struct hdaps_event {
+	__s64 time_ns;	/* capture time, CLOCK_MONOTONIC */
+	__s16 x, y;	/* position, after axis orientation fixup */
+	__u8  temp;	/* device temperature in Celsius */
+	__u8  kmact;	/* HDAPS_KMACT_* activity since the previous readout */
+	__u16 reserved;
+};
+
+#define HDAPS_KMACT_KEYBOARD	0x20
+#define HDAPS_KMACT_MOUSE	0x40
+
+/*
+ * Wakeup watermark: read() blocks, and poll() reports no data, until at
+ * least this many records are queued (or read() asks for fewer).
+ * Default 1, max HDAPS_MAX_WATERMARK.
+ */
+#define HDAPS_MAX_WATERMARK	512
+
+#define HDAPS_IOC_MAGIC		'h'
+#define HDAPS_IOC_SET_WATERMARK	_IOW(HDAPS_IOC_MAGIC, 0xA0, __u32)
+#define HDAPS_IOC_GET_WATERMARK	_IOR(HDAPS_IOC_MAGIC, 0xA1, __u32)
+
+/*
+ * Per-reader flags. HDAPS_STREAM_FILTERED selects x, y as output by the
+ * driver's filter chain (see the "filter" sysfs attribute) instead of
+ * the unfiltered position. HDAPS_STREAM_AVERAGE makes a reader with its
+ * own rate get the mean of the readouts since its previous record,
+ * rather than just the latest one.
+ */
+#define HDAPS_STREAM_FILTERED	0x01
+#define HDAPS_STREAM_AVERAGE	0x02
+
+#define HDAPS_IOC_SET_FLAGS	_IOW(HDAPS_IOC_MAGIC, 0xA2, __u32)
+#define HDAPS_IOC_GET_FLAGS	_IOR(HDAPS_IOC_MAGIC, 0xA3, __u32)
+
+/*
+ * Per-reader rate in Hz (at most 1000), or 0 for every readout. The
+ * driver samples at the highest rate its users need and decimates for
+ * each reader.
+ */
+#define HDAPS_IOC_SET_RATE	_IOW(HDAPS_IOC_MAGIC, 0xA4, __u32)
+#define HDAPS_IOC_GET_RATE	_IOR(HDAPS_IOC_MAGIC, 0xA5, __u32)
+
+#endif /* _HDAPS_H */
@@ -43,7 +43,24 @@
 #include <linux/delay.h>
 #include <linux/version.h>
 #include "thinkpad_ec.h"
+#include "tp_smapi.h"
 #include <linux/platform_device.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/hwmon.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kobject.h>
+#include <net/genetlink.h>
+#ifdef CONFIG_ACPI
+#include <linux/acpi.h>
+#endif
+#ifdef CONFIG_PERF_EVENTS
+#include <linux/perf_event.h>
+#endif
 #include <asm/uaccess.h>
 #include <asm/io.h>
 
@@ -238,12 +255,17 @@ static int smapi_request(u32 inEBX, u32 inECX,
 	return ret;
 }
 
-/* Convenience wrapper: discard output arguments */
+static void tp_power_cache_invalidate(void);
+
+/* Convenience wrapper: discard output arguments. Any write may change
+ * the charging state, so it drops the cached power state. */
 static int smapi_write(u32 inEBX, u32 inECX,
 		       u32 inEDI, u32 inESI, const char **msg)
 {
-	return smapi_request(inEBX, inECX, inEDI, inESI,
-			     NULL, NULL, NULL, NULL, NULL, msg);
+	int ret = smapi_request(inEBX, inECX, inEDI, inESI,
+				NULL, NULL, NULL, NULL, NULL, msg);
+	tp_power_cache_invalidate();
+	return ret;
 }
 
 
@@ -259,6 +281,28 @@ enum thresh_type {
 };
 #define THRESH_NAME(which) ((which == THRESH_START) ? "start" : "stop")
 
+/* Settings last written through this driver, -1 = unknown. Lets the charge
+ * policy skip redundant writes; forgotten when the EC may have lost them. */
+static int known_thresh[2][2] = { { -1, -1 }, { -1, -1 } }; /* [bat][which] */
+static int known_force_discharge[2] = { -1, -1 };
+/* Settings the charge policy failed to write, -1 = none. It doesn't retry
+ * them until they're forgotten here or the policy is changed. */
+static int failed_thresh[2][2] = { { -1, -1 }, { -1, -1 } };
+static int failed_force_discharge[2] = { -1, -1 };
+
+/* Caller must not hold smapi_mutex */
+static void forget_known_settings(int bat)
+{
+	down(&smapi_mutex);
+	known_thresh[bat][THRESH_STOP] = -1;
+	known_thresh[bat][THRESH_START] = -1;
+	known_force_discharge[bat] = -1;
+	failed_thresh[bat][THRESH_STOP] = -1;
+	failed_thresh[bat][THRESH_START] = -1;
+	failed_force_discharge[bat] = -1;
+	up(&smapi_mutex);
+}
+
 /**
  * __get_real_thresh - read battery charge start/stop threshold from SMAPI
  * @bat:    battery number (0 or 1)
@@ -323,6 +367,7 @@ static int set_real_thresh(int bat, enum thresh_type which, int thresh)
 		return ret;
 
 	ret = smapi_write(ebx, ecx, getDI, getSI, &msg);
+	known_thresh[bat][which] = ret ? -1 : thresh;
 	if (ret)
 		TPRINTK(KERN_NOTICE, "set %s to %d for bat=%d failed: %s",
 			THRESH_NAME(which), thresh, bat, msg);
@@ -442,6 +487,7 @@ static int set_force_discharge(int bat, int enabled)
 
 	ecx = ((bat+1)<<8) | (ecx&0x000000FA) | (enabled?0x00000001:0);
 	ret = smapi_write(SMAPI_SET_FORCE_DISCHARGE, ecx, 0, 0, &msg);
+	known_force_discharge[bat] = ret ? -1 : enabled;
 	if (ret)
 		TPRINTK(KERN_NOTICE, "set to %d failed for bat=%d: %s",
 			enabled, bat, msg);
@@ -487,15 +533,26 @@ static int get_thresh(int bat, enum thresh_type which, int *thresh)
 }
 
 
-/* Set charge start/stop threshold (1..100),
+static void tp_genl_thresh_event(int bat, enum thresh_type which, int thresh);
+
+/* Convert a charge start/stop threshold (1..100) to the SMAPI value,
  * substituting default values if needed and applying BATMAT_FIX. */
-static int set_thresh(int bat, enum thresh_type which, int thresh)
+static int thresh_to_real(enum thresh_type which, int thresh)
 {
 	if (which == THRESH_STOP && thresh == DEFAULT_THRESH_STOP)
-		thresh = 0; /* 100 is out of range, but default means 100 */
+		return 0; /* 100 is out of range, but default means 100 */
 	if (which == THRESH_START)
-		thresh -= BATMAX_FIX;
-	return set_real_thresh(bat, which, thresh);
+		return thresh - BATMAX_FIX;
+	return thresh;
+}
+
+/* Set charge start/stop threshold (1..100) */
+static int set_thresh(int bat, enum thresh_type which, int thresh)
+{
+	int ret = set_real_thresh(bat, which, thresh_to_real(which, thresh));
+	if (!ret)
+		tp_genl_thresh_event(bat, which, thresh);
+	return ret;
 }
 
 /*********************************************************************
@@ -525,6 +582,107 @@ static int read_tp_ec_row(u8 arg0, int bat, u8 j, u8 *dataval)
 	return ret;
 }
 
+/* Presence bits in byte 0 of EC row 0x01 (same for any battery argument) */
+#define EC_PRESENT_AC		0x80
+#define EC_PRESENT_BAT0		0x40
+#define EC_PRESENT_BAT1		0x20
+#define EC_PRESENT_BAT(bat)	((bat) ? EC_PRESENT_BAT1 : EC_PRESENT_BAT0)
+#define EC_PRESENT_MASK		(EC_PRESENT_AC|EC_PRESENT_BAT0|EC_PRESENT_BAT1)
+
+/*
+ * The status cache serves frequent readers such as hwmon scrapers.
+ * Values served from it may be up to status_cache_ms old.
+ */
+static unsigned int status_cache_ms = 1000;
+module_param_named(status_cache_ms, status_cache_ms, uint, 0600);
+MODULE_PARM_DESC(status_cache_ms, "Max age of cached battery status (msec)");
+
+/*
+ * Power state cache: EC row 0x01 of each battery, which holds AC and
+ * battery presence and the charging state. Cached rows are dropped on an
+ * SMAPI write, suspend, or a change seen by the battery monitor. When an
+ * ACPI AC adapter or battery device is present, firmware also notifies us
+ * of changes, and rows are kept for up to TP_POWER_CACHE_MAX_MS in case a
+ * notification is lost. Otherwise nothing tells us about changes, so rows
+ * are only served for status_cache_ms.
+ */
+#define TP_POWER_CACHE_MAX_MS	60000
+static DEFINE_SPINLOCK(tp_power_cache_lock);
+static int tp_power_cache_enabled;
+static int tp_power_cache_events;       /* ACPI notifications expected */
+static unsigned int tp_power_cache_gen; /* bumped on each invalidation */
+static u8 tp_power_cache_valid;         /* bitmap of batteries */
+static u8 tp_power_cache_rows[2][TP_CONTROLLER_ROW_LEN];
+static u64 tp_power_cache_jiffies[2];
+
+static void tp_power_cache_invalidate(void)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&tp_power_cache_lock, flags);
+	tp_power_cache_valid = 0;
+	++tp_power_cache_gen;
+	spin_unlock_irqrestore(&tp_power_cache_lock, flags);
+}
+
+/**
+ * tp_power_cache_put - store a row 0x01 that was read after invalidation
+ * number @gen, unless the cache was invalidated again since.
+ */
+static void tp_power_cache_put(int bat, const u8 *row, unsigned int gen)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&tp_power_cache_lock, flags);
+	if (tp_power_cache_enabled && gen == tp_power_cache_gen) {
+		memcpy(tp_power_cache_rows[bat], row, TP_CONTROLLER_ROW_LEN);
+		tp_power_cache_jiffies[bat] = get_jiffies_64();
+		tp_power_cache_valid |= 1 << bat;
+	}
+	spin_unlock_irqrestore(&tp_power_cache_lock, flags);
+}
+
+/**
+ * refresh_power_row - read EC row 0x01 for a battery, updating the cache
+ * @bat: 0 for battery 0, 1 for battery 1
+ * @row: output buffer of TP_CONTROLLER_ROW_LEN bytes
+ */
+static int refresh_power_row(int bat, u8 *row)
+{
+	unsigned long flags;
+	unsigned int gen;
+	int ret;
+
+	spin_lock_irqsave(&tp_power_cache_lock, flags);
+	gen = tp_power_cache_gen;
+	spin_unlock_irqrestore(&tp_power_cache_lock, flags);
+
+	ret = read_tp_ec_row(1, bat, 0, row);
+	if (!ret)
+		tp_power_cache_put(bat, row, gen);
+	return ret;
+}
+
+/**
+ * read_power_row - get EC row 0x01 for a battery, from the cache if valid
+ * and fresh enough
+ */
+static int read_power_row(int bat, u8 *row)
+{
+	unsigned long flags;
+	unsigned int max_ms;
+
+	spin_lock_irqsave(&tp_power_cache_lock, flags);
+	max_ms = tp_power_cache_events ? TP_POWER_CACHE_MAX_MS : status_cache_ms;
+	if ((tp_power_cache_valid & (1 << bat)) &&
+	    time_before_eq64(get_jiffies_64(), tp_power_cache_jiffies[bat] +
+			     msecs_to_jiffies(max_ms))) {
+		memcpy(row, tp_power_cache_rows[bat], TP_CONTROLLER_ROW_LEN);
+		spin_unlock_irqrestore(&tp_power_cache_lock, flags);
+		return 0;
+	}
+	spin_unlock_irqrestore(&tp_power_cache_lock, flags);
+	return refresh_power_row(bat, row);
+}
+
 /**
  * power_device_present - check for presence of battery or AC power
  * @bat: 0 for battery 0, 1 for battery 1, otherwise AC power
@@ -534,7 +692,7 @@ static int power_device_present(int bat)
 {
 	u8 row[TP_CONTROLLER_ROW_LEN];
 	u8 test;
-	int ret = read_tp_ec_row(1, bat, 0, row);
+	int ret = read_power_row(bat == 1, row);
 	if (ret)
 		return ret;
 	switch (bat) {
@@ -553,7 +711,7 @@ static int power_device_present(int bat)
 static int bat_has_status(int bat)
 {
 	u8 row[TP_CONTROLLER_ROW_LEN];
-	int ret = read_tp_ec_row(1, bat, 0, row);
+	int ret = read_power_row(bat, row);
 	if (ret)
 		return ret;
 	if ((row[0] & (bat?0x20:0x40)) == 0) /* no battery */
@@ -564,170 +722,368 @@ static int bat_has_status(int bat)
 }
 
 /**
- * get_tp_ec_bat_16 - read a 16-bit value from EC battery status data
- * @arg0: first argument to EC
- * @off: offset in row returned from EC
- * @bat: battery (0 or 1)
- * @val: the 16-bit value obtained
- * Returns nonzero on error.
+ * bat_state_from_row - decode the charging state in EC row 0x01
+ * Returns an enum tp_smapi_bat_state.
  */
-static int get_tp_ec_bat_16(u8 arg0, int offset, int bat, u16 *val)
+static u8 bat_state_from_row(int bat, const u8 *row)
 {
-	u8 row[TP_CONTROLLER_ROW_LEN];
-	int ret;
-	if (bat_has_status(bat) != 1)
-		return -ENXIO;
-	ret = read_tp_ec_row(arg0, bat, 0, row);
-	if (ret)
-		return ret;
-	*val = *(u16 *)(row+offset);
-	return 0;
+	if (!(row[0] & EC_PRESENT_BAT(bat)) || !(row[1] & 0x60))
+		return TP_SMAPI_BAT_NONE;
+	switch (row[1] & 0xf0) {
+	case 0xc0: return TP_SMAPI_BAT_IDLE;
+	case 0xd0: return TP_SMAPI_BAT_DISCHARGING;
+	case 0xe0: return TP_SMAPI_BAT_CHARGING;
+	default:   return TP_SMAPI_BAT_UNKNOWN;
+	}
 }
 
 /*********************************************************************
- * sysfs attributes for batteries -
- * definitions and helper functions
+ * Battery objects: one is created at runtime for each battery that the
+ * EC reports as present. It holds the battery's sysfs attributes and
+ * cached state.
  */
 
-/* A custom device attribute struct which holds a battery number */
+#define TP_MAX_BATS 2 /* the EC reports presence of batteries 0 and 1 */
+
+struct tp_battery;
+struct bat_field;
+
+/* A custom device attribute struct which holds a battery */
 struct bat_device_attribute {
 	struct device_attribute dev_attr;
-	int bat;
+	struct tp_battery *battery;
+	const struct bat_field *field; /* for show_battery_field() */
 };
 
+struct tp_battery {
+	int bat;                     /* battery number */
+	char name[8];                /* "BAT<n>", sysfs group name */
+
+	/* Rate-limited cache of battery status (EC row 0x01): */
+	struct mutex status_lock;
+	u64 status_jiffies;          /* time of last successful read */
+	int status_valid;
+	u8 status_row[TP_CONTROLLER_ROW_LEN];
+
+	/* Cache of static battery information (EC rows 0x03-0x08), valid
+	 * for the battery whose serial number is static_serial: */
+	struct mutex static_lock;
+	u8 static_valid;             /* bitmap of cached rows */
+	u16 static_serial;
+	u8 static_rows[6][TP_CONTROLLER_ROW_LEN];
+
+	struct device *hwmon_dev;
+	struct attribute_group group;
+	struct attribute **attrs;    /* NULL-terminated, follows dev_attrs */
+	struct bat_device_attribute dev_attrs[]; /* bat_attr_descs[], then
+						  * bat_fields[] */
+};
+
+static struct tp_battery *tp_bats[TP_MAX_BATS];
+static DEFINE_MUTEX(tp_bats_mutex); /* held while adding/removing, and by
+				     * users of tp_bats[] outside sysfs */
+
 /**
- * attr_get_bat - get the battery to which the attribute belongs
+ * read_bat_status_cached - read battery status row, through the cache
+ * @b: battery
+ * @row: result vector
+ * @max_ms: max age of a cached row to serve, at most status_cache_ms
+ * Returns 0 on success, -ENXIO if the battery has no status, or the EC
+ * read error.
  */
-static int attr_get_bat(struct device_attribute *attr)
+static int read_bat_status_cached(struct tp_battery *b, u8 *row,
+				  unsigned int max_ms)
 {
-	return container_of(attr, struct bat_device_attribute, dev_attr)->bat;
+	int ret = 0;
+
+	max_ms = min(max_ms, status_cache_ms);
+	mutex_lock(&b->status_lock);
+	if (!b->status_valid ||
+	    time_after64(get_jiffies_64(), b->status_jiffies +
+			 msecs_to_jiffies(max_ms))) {
+		ret = read_tp_ec_row(1, b->bat, 0, b->status_row);
+		b->status_valid = !ret;
+		b->status_jiffies = get_jiffies_64();
+	}
+	if (!ret)
+		memcpy(row, b->status_row, TP_CONTROLLER_ROW_LEN);
+	mutex_unlock(&b->status_lock);
+	if (ret)
+		return ret;
+	if (!(row[0] & (b->bat?0x20:0x40)) || !(row[1] & 0x60))
+		return -ENXIO; /* no battery, or no status */
+	return 0;
 }
 
-/**
- * show_tp_ec_bat_u16 - show an unsigned 16-bit battery attribute
- * @arg0: specified 1st argument of EC raw to read
- * @offset: byte offset in EC raw data
- * @mul: correction factor to multiply by
- * @na_msg: string to output is value not available (0xFFFFFFFF)
- * @attr: battery attribute
- * @buf: output buffer
- * The 16-bit value is read from the EC, treated as unsigned,
- * transformed as x->mul*x, and printed to the buffer.
- * If the value is 0xFFFFFFFF and na_msg!=%NULL, na_msg is printed instead.
+/*
+ * Manufacturer, model, serial number, design capacity and the like never
+ * change while a given battery stays inserted, so the rows holding them
+ * are read from the EC once and then served from memory. The cache is
+ * keyed on the serial number (EC row 0x03): rows are cached only together
+ * with row 0x03, and tp_battery_revalidate() drops them if the serial
+ * changed. The cache also goes away with the battery object on removal.
  */
-static ssize_t show_tp_ec_bat_u16(u8 arg0, int offset, int mul,
-			      const char *na_msg,
-			      struct device_attribute *attr, char *buf)
+#define BAT_STATIC_MIN_ARG0	0x03
+#define BAT_STATIC_MAX_ARG0	0x08
+#define BAT_SERIAL_ARG0		0x03
+#define BAT_SERIAL_OFFSET	10
+
+static int bat_static_serial(const u8 *row)
 {
-	u16 val;
-	int ret = get_tp_ec_bat_16(arg0, offset, attr_get_bat(attr), &val);
-	if (ret)
-		return ret;
-	if (na_msg && val == 0xFFFF)
-		return sprintf(buf, "%s\n", na_msg);
-	else
-		return sprintf(buf, "%u\n", mul*(unsigned int)val);
+	return *(u16 *)(row+BAT_SERIAL_OFFSET);
 }
 
 /**
- * show_tp_ec_bat_s16 - show an signed 16-bit battery attribute
- * @arg0: specified 1st argument of EC raw to read
- * @offset: byte offset in EC raw data
- * @mul: correction factor to multiply by
- * @add: correction term to add after multiplication
- * @attr: battery attribute
- * @buf: output buffer
- * The 16-bit value is read from the EC, treated as signed,
- * transformed as x->mul*x+add, and printed to the buffer.
+ * __get_bat_static_row - read a static row through the cache
+ * Caller must hold b->static_lock.
  */
-static ssize_t show_tp_ec_bat_s16(u8 arg0, int offset, int mul, int add,
-			      struct device_attribute *attr, char *buf)
+static int __get_bat_static_row(struct tp_battery *b, u8 arg0, u8 *row)
 {
-	u16 val;
-	int ret = get_tp_ec_bat_16(arg0, offset, attr_get_bat(attr), &val);
-	if (ret)
-		return ret;
-	return sprintf(buf, "%d\n", mul*(s16)val+add);
+	int idx = arg0 - BAT_STATIC_MIN_ARG0;
+	int ret;
+
+	if (!(b->static_valid & (1 << idx))) {
+		if (bat_has_status(b->bat) != 1)
+			return -ENXIO;
+		ret = read_tp_ec_row(arg0, b->bat, 0, b->static_rows[idx]);
+		if (ret)
+			return ret;
+		if (arg0 == BAT_SERIAL_ARG0)
+			b->static_serial = bat_static_serial(b->static_rows[idx]);
+		b->static_valid |= 1 << idx;
+	}
+	memcpy(row, b->static_rows[idx], TP_CONTROLLER_ROW_LEN);
+	return 0;
 }
 
 /**
- * show_tp_ec_bat_str - show a string from EC battery status data
- * @arg0: specified 1st argument of EC raw to read
- * @offset: byte offset in EC raw data
- * @maxlen: maximum string length
- * @attr: battery attribute
- * @buf: output buffer
+ * get_tp_ec_bat_row - read a data row of a battery from the EC
+ * @b: battery
+ * @arg0: EC command code
+ * @row: result vector
+ * Static rows are served from the battery's cache. Returns -ENXIO if the
+ * battery can't report status.
  */
-static ssize_t show_tp_ec_bat_str(u8 arg0, int offset, int maxlen,
-			      struct device_attribute *attr, char *buf)
+static int get_tp_ec_bat_row(struct tp_battery *b, u8 arg0, u8 *row)
 {
-	int bat = attr_get_bat(attr);
-	u8 row[TP_CONTROLLER_ROW_LEN];
+	u8 serial_row[TP_CONTROLLER_ROW_LEN];
 	int ret;
-	if (bat_has_status(bat) != 1)
-		return -ENXIO;
-	ret = read_tp_ec_row(arg0, bat, 0, row);
-	if (ret)
-		return ret;
-	strncpy(buf, (char *)row+offset, maxlen);
-	buf[maxlen] = 0;
-	strcat(buf, "\n");
-	return strlen(buf);
+
+	if (arg0 < BAT_STATIC_MIN_ARG0 || arg0 > BAT_STATIC_MAX_ARG0) {
+		if (bat_has_status(b->bat) != 1)
+			return -ENXIO;
+		return read_tp_ec_row(arg0, b->bat, 0, row);
+	}
+
+	mutex_lock(&b->static_lock);
+	/* Everything we cache must belong to a known serial number: */
+	ret = __get_bat_static_row(b, BAT_SERIAL_ARG0, serial_row);
+	if (!ret)
+		ret = __get_bat_static_row(b, arg0, row);
+	mutex_unlock(&b->static_lock);
+	return ret;
 }
 
 /**
- * show_tp_ec_bat_power - show a power readout from EC battery status data
- * @arg0: specified 1st argument of EC raw to read
- * @offV: byte offset of voltage in EC raw data
- * @offI: byte offset of current in EC raw data
- * @attr: battery attribute
- * @buf: output buffer
- * Computes the power as current*voltage from the two given readout offsets.
+ * tp_battery_revalidate - drop cached static info if battery was swapped
+ * For use when a swap could have gone unnoticed (e.g., during suspend).
+ * Costs a single EC read, and only if anything is cached.
  */
-static ssize_t show_tp_ec_bat_power(u8 arg0, int offV, int offI,
-				struct device_attribute *attr, char *buf)
+static void tp_battery_revalidate(struct tp_battery *b)
 {
 	u8 row[TP_CONTROLLER_ROW_LEN];
-	int milliamp, millivolt, ret;
-	int bat = attr_get_bat(attr);
-	if (bat_has_status(bat) != 1)
-		return -ENXIO;
-	ret = read_tp_ec_row(1, bat, 0, row);
-	if (ret)
-		return ret;
-	millivolt = *(u16 *)(row+offV);
-	milliamp = *(s16 *)(row+offI);
-	return sprintf(buf, "%d\n", milliamp*millivolt/1000); /* units: mW */
+
+	mutex_lock(&b->static_lock);
+	if (b->static_valid &&
+	    (read_tp_ec_row(BAT_SERIAL_ARG0, b->bat, 0, row) ||
+	     bat_static_serial(row) != b->static_serial)) {
+		DPRINTK("dropping cached info of BAT%d", b->bat);
+		b->static_valid = 0;
+	}
+	mutex_unlock(&b->static_lock);
+}
+
+/*********************************************************************
+ * sysfs attributes for batteries -
+ * definitions and helper functions
+ */
+
+/**
+ * attr_get_battery - get the battery object to which the attribute belongs
+ */
+static struct tp_battery *attr_get_battery(struct device_attribute *attr)
+{
+	return container_of(attr, struct bat_device_attribute,
+			    dev_attr)->battery;
+}
+
+/**
+ * attr_get_bat - get the battery to which the attribute belongs
+ */
+static int attr_get_bat(struct device_attribute *attr)
+{
+	return attr_get_battery(attr)->bat;
+}
+
+/*
+ * Most battery attributes are plain fields in some EC row. They are
+ * described by the following table and shown by show_battery_field().
+ * References are to the SBS spec v1.1.
+ */
+
+enum bat_field_type {
+	BAT_FIELD_U16,   /* unsigned 16-bit, shown as mul*x */
+	BAT_FIELD_S16,   /* signed 16-bit, shown as mul*x+add */
+	BAT_FIELD_STR,   /* string of at most aux bytes */
+	BAT_FIELD_DATE,  /* bit-packed date, shown as YYYY-MM-DD */
+	BAT_FIELD_POWER, /* voltage at offset times current at offset aux */
+};
+
+struct bat_field {
+	const char *name;
+	u8 arg0;            /* EC row holding the field */
+	u8 offset;          /* byte offset in the row */
+	u8 type;            /* enum bat_field_type */
+	u8 aux;             /* STR: max length; POWER: offset of current */
+	s16 mul;            /* correction factor to multiply by */
+	s32 add;            /* correction term to add after multiplication */
+	const char *na_msg; /* U16: shown if value not available (0xFFFF) */
+};
+
+#define BAT_U16(_NAME, _ARG0, _OFF, _MUL, _NA) \
+	{ #_NAME, _ARG0, _OFF, BAT_FIELD_U16, 0, _MUL, 0, _NA }
+#define BAT_S16(_NAME, _ARG0, _OFF, _MUL, _ADD) \
+	{ #_NAME, _ARG0, _OFF, BAT_FIELD_S16, 0, _MUL, _ADD, NULL }
+#define BAT_STR(_NAME, _ARG0, _OFF, _LEN) \
+	{ #_NAME, _ARG0, _OFF, BAT_FIELD_STR, _LEN, 1, 0, NULL }
+#define BAT_DATE(_NAME, _ARG0, _OFF) \
+	{ #_NAME, _ARG0, _OFF, BAT_FIELD_DATE, 0, 1, 0, NULL }
+#define BAT_POWER(_NAME, _ARG0, _OFFV, _OFFI) \
+	{ #_NAME, _ARG0, _OFFV, BAT_FIELD_POWER, _OFFI, 1, 0, NULL }
+
+static const struct bat_field bat_fields[] = {
+	/* type: string. p34: ManufacturerName() */
+	BAT_STR(manufacturer, 4, 2, TP_CONTROLLER_ROW_LEN-2),
+	/* type: string. p34: DeviceName() */
+	BAT_STR(model, 5, 2, TP_CONTROLLER_ROW_LEN-2),
+	/* type: string */
+	BAT_STR(barcoding, 7, 2, TP_CONTROLLER_ROW_LEN-2),
+	/* type: string. p34-35: DeviceChemistry() */
+	BAT_STR(chemistry, 6, 2, 5),
+	/* units: mV. p24: Voltage() */
+	BAT_U16(voltage, 1, 6, 1, NULL),
+	/* units: mV. p32: DesignVoltage() */
+	BAT_U16(design_voltage, 3, 4, 1, NULL),
+	/* units: mV. p37,39: ChargingVoltage() */
+	BAT_U16(charging_max_voltage, 9, 8, 1, NULL),
+	/* units: mV */
+	BAT_U16(group0_voltage, 0xA, 12, 1, NULL),
+	BAT_U16(group1_voltage, 0xA, 10, 1, NULL),
+	BAT_U16(group2_voltage, 0xA, 8, 1, NULL),
+	BAT_U16(group3_voltage, 0xA, 6, 1, NULL),
+	/* units: mA. p24: Current() */
+	BAT_S16(current_now, 1, 8, 1, 0),
+	/* units: mA. p24: AverageCurrent() */
+	BAT_S16(current_avg, 1, 10, 1, 0),
+	/* units: mA. p36,38: ChargingCurrent() */
+	BAT_S16(charging_max_current, 9, 6, 1, 0),
+	/* units: mW. Voltage()*Current() */
+	BAT_POWER(power_now, 1, 6, 8),
+	/* units: mW. Voltage()*AverageCurrent() */
+	BAT_POWER(power_avg, 1, 6, 10),
+	/* units: percent. p25: RelativeStateOfCharge() */
+	BAT_U16(remaining_percent, 1, 12, 1, NULL),
+	/* units: percent. p25: MaxError() */
+	BAT_U16(remaining_percent_error, 9, 4, 1, NULL),
+	/* units: minutes. p27: AverageTimeToFull() */
+	BAT_U16(remaining_charging_time, 2, 8, 1, "not_charging"),
+	/* units: minutes. p27: RunTimeToEmpty() */
+	BAT_U16(remaining_running_time, 2, 6, 1, "not_discharging"),
+	/* units: minutes. p27: RunTimeToEmpty() */
+	BAT_U16(remaining_running_time_now, 2, 4, 1, "not_discharging"),
+	/* units: mWh. p26. */
+	BAT_U16(remaining_capacity, 1, 14, 10, ""),
+	/* units: mWh. p26: FullChargeCapacity() */
+	BAT_U16(last_full_capacity, 2, 2, 10, ""),
+	/* units: mWh. p32: DesignCapacity() */
+	BAT_U16(design_capacity, 3, 2, 10, ""),
+	/* units: ordinal. p32: CycleCount() */
+	BAT_U16(cycle_count, 2, 12, 1, ""),
+	/* units: millicelsius. Temperature()*10 */
+	BAT_S16(temperature, 1, 4, 100, -273100),
+	/* type: int. p34: SerialNumber() */
+	BAT_U16(serial, 3, 10, 1, ""),
+	/* type: YYYY-MM-DD. p34: ManufactureDate() */
+	BAT_DATE(manufacture_date, 3, 8),
+	/* type: YYYY-MM-DD */
+	BAT_DATE(first_use_date, 8, 2),
+};
+
+/**
+ * bat_fields_rows - get the EC rows needed for a set of fields
+ * @fields: array of fields
+ * @n: number of fields
+ * Returns a bitmap of the needed arg0 values, for batch readers that
+ * want to read each row only once.
+ */
+static u16 bat_fields_rows(const struct bat_field *fields, int n)
+{
+	u16 rows = 0;
+	while (n--)
+		rows |= 1 << fields[n].arg0;
+	return rows;
 }
 
 /**
- * show_tp_ec_bat_date - decode and show a date from EC battery status data
- * @arg0: specified 1st argument of EC raw to read
- * @offset: byte offset in EC raw data
- * @attr: battery attribute
+ * format_bat_field - format a battery field from its EC row
+ * @f: field descriptor
+ * @row: data of EC row @f->arg0
  * @buf: output buffer
+ * @size: size of @buf
  */
-static ssize_t show_tp_ec_bat_date(u8 arg0, int offset,
-			       struct device_attribute *attr, char *buf)
+static int format_bat_field(const struct bat_field *f, const u8 *row,
+			    char *buf, size_t size)
 {
-	u8 row[TP_CONTROLLER_ROW_LEN];
-	u16 v;
-	int ret;
+	u16 v = *(u16 *)(row+f->offset);
 	int day, month, year;
-	int bat = attr_get_bat(attr);
-	if (bat_has_status(bat) != 1)
-		return -ENXIO;
-	ret = read_tp_ec_row(arg0, bat, 0, row);
-	if (ret)
-		return ret;
 
-	/* Decode bit-packed: v = day | (month<<5) | ((year-1980)<<9) */
-	v = *(u16 *)(row+offset);
-	day = v & 0x1F;
-	month = (v >> 5) & 0xF;
-	year = (v >> 9) + 1980;
+	switch (f->type) {
+	case BAT_FIELD_U16:
+		if (f->na_msg && v == 0xFFFF)
+			return scnprintf(buf, size, "%s\n", f->na_msg);
+		return scnprintf(buf, size, "%u\n", f->mul*(unsigned int)v);
+	case BAT_FIELD_S16:
+		return scnprintf(buf, size, "%d\n", f->mul*(s16)v + f->add);
+	case BAT_FIELD_STR:
+		return scnprintf(buf, size, "%.*s\n", f->aux,
+				 (const char *)row+f->offset);
+	case BAT_FIELD_DATE:
+		/* Decode bit-packed: v = day | (month<<5) | ((year-1980)<<9) */
+		day = v & 0x1F;
+		month = (v >> 5) & 0xF;
+		year = (v >> 9) + 1980;
+		return scnprintf(buf, size, "%04d-%02d-%02d\n",
+				 year, month, day);
+	case BAT_FIELD_POWER: /* units: mW */
+		return scnprintf(buf, size, "%d\n",
+				 *(s16 *)(row+f->aux) * (int)v / 1000);
+	}
+	return -EINVAL;
+}
 
-	return sprintf(buf, "%04d-%02d-%02d\n", year, month, day);
+/**
+ * show_battery_field - show a battery attribute described by bat_fields[]
+ */
+static ssize_t show_battery_field(
+	struct device *dev, struct device_attribute *attr, char *buf)
+{
+	const struct bat_field *f = container_of(attr,
+		struct bat_device_attribute, dev_attr)->field;
+	u8 row[TP_CONTROLLER_ROW_LEN];
+	int ret = get_tp_ec_bat_row(attr_get_battery(attr), f->arg0, row);
+	if (ret)
+		return ret;
+	return format_bat_field(f, row, buf, PAGE_SIZE);
 }
 
 
@@ -915,265 +1271,261 @@ static ssize_t show_battery_state(
 	const char *txt;
 	int ret;
 	int bat = attr_get_bat(attr);
-	if (bat_has_status(bat) != 1)
-		return sprintf(buf, "none\n");
-	ret = read_tp_ec_row(1, bat, 0, row);
+	ret = read_power_row(bat, row);
 	if (ret)
 		return ret;
-	switch (row[1] & 0xf0) {
-	case 0xc0: txt = "idle"; break;
-	case 0xd0: txt = "discharging"; break;
-	case 0xe0: txt = "charging"; break;
-	default:   return sprintf(buf, "unknown (0x%x)\n", row[1]);
+	switch (bat_state_from_row(bat, row)) {
+	case TP_SMAPI_BAT_NONE:        txt = "none"; break;
+	case TP_SMAPI_BAT_IDLE:        txt = "idle"; break;
+	case TP_SMAPI_BAT_DISCHARGING: txt = "discharging"; break;
+	case TP_SMAPI_BAT_CHARGING:    txt = "charging"; break;
+	default: return sprintf(buf, "unknown (0x%x)\n", row[1]);
 	}
 	return sprintf(buf, "%s\n", txt);  /* type: string from fixed set */
 }
 
-static ssize_t show_battery_manufacturer(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* type: string. SBS spec v1.1 p34: ManufacturerName() */
-	return show_tp_ec_bat_str(4, 2, TP_CONTROLLER_ROW_LEN-2, attr, buf);
-}
+/*
+ * Battery dump: a hex dump of all EC readouts related to a battery. Some of
+ * the enumerated values don't really exist (i.e., the EC function just
+ * leaves them untouched); we use a kludge to detect and denote these.
+ */
+#define MIN_DUMP_ARG0 0x00
+#define MAX_DUMP_ARG0 0x0a /* 0x0b is useful too but hangs old EC firmware */
+#define MAX_DUMP_ARG0_EXT 0x0b
+#define DUMP_JUNKA 0xAA /* junk values for testing changes */
+#define DUMP_JUNKB 0x55
 
-static ssize_t show_battery_model(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* type: string. SBS spec v1.1 p34: DeviceName() */
-	return show_tp_ec_bat_str(5, 2, TP_CONTROLLER_ROW_LEN-2, attr, buf);
-}
+static bool dump_row_0b;   /* include row 0x0b in debugfs dumps? */
 
-static ssize_t show_battery_barcoding(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* type: string */
-	return show_tp_ec_bat_str(7, 2, TP_CONTROLLER_ROW_LEN-2, attr, buf);
-}
+struct bat_dump {
+	int nrows;
+	u16 valid[MAX_DUMP_ARG0_EXT-MIN_DUMP_ARG0+1]; /* bytes set by EC */
+	u8 row[MAX_DUMP_ARG0_EXT-MIN_DUMP_ARG0+1][TP_CONTROLLER_ROW_LEN];
+};
 
-static ssize_t show_battery_chemistry(
-	struct device *dev, struct device_attribute *attr, char *buf)
+/**
+ * read_bat_dump - read all battery rows under a single EC lock hold
+ * @bat: battery number, 0 or 1
+ * @max_arg0: last row to read (MAX_DUMP_ARG0 or MAX_DUMP_ARG0_EXT)
+ * @d: result
+ * Each row is read twice with different junk values, to detect unused
+ * output bytes which are left unchanged.
+ */
+static int read_bat_dump(int bat, u8 max_arg0, struct bat_dump *d)
 {
-	/* type: string. SBS spec v1.1 p34-35: DeviceChemistry() */
-	return show_tp_ec_bat_str(6, 2, 5, attr, buf);
-}
+	struct thinkpad_ec_row args = { .mask = 0xFFFF };
+	struct thinkpad_ec_row rowa = { .mask = 0xFFFF },
+			       rowb = { .mask = 0xFFFF };
+	int i, n, ret;
 
-static ssize_t show_battery_voltage(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: mV. SBS spec v1.1 p24: Voltage() */
-	return show_tp_ec_bat_u16(1, 6, 1, NULL, attr, buf);
+	ret = thinkpad_ec_lock();
+	if (ret)
+		return ret;
+	for (n = 0; n <= max_arg0 - MIN_DUMP_ARG0; ++n) {
+		args.val[0x0] = MIN_DUMP_ARG0 + n;
+		args.val[0xF] = (u8)bat;
+		memset(args.val+1, DUMP_JUNKA, TP_CONTROLLER_ROW_LEN-2);
+		ret = thinkpad_ec_read_row(&args, &rowa);
+		if (ret)
+			break;
+		memset(args.val+1, DUMP_JUNKB, TP_CONTROLLER_ROW_LEN-2);
+		ret = thinkpad_ec_read_row(&args, &rowb);
+		if (ret)
+			break;
+		memcpy(d->row[n], rowa.val, TP_CONTROLLER_ROW_LEN);
+		d->valid[n] = 0;
+		for (i = 0; i < TP_CONTROLLER_ROW_LEN; i++)
+			if (rowa.val[i] != DUMP_JUNKA || rowb.val[i] != DUMP_JUNKB)
+				d->valid[n] |= 1 << i;
+	}
+	thinkpad_ec_unlock();
+	d->nrows = n;
+	return ret;
 }
 
-static ssize_t show_battery_design_voltage(
+/**
+ * show_battery_dump - show the battery's dump attribute
+ */
+static ssize_t show_battery_dump(
 	struct device *dev, struct device_attribute *attr, char *buf)
 {
-	/* units: mV. SBS spec v1.1 p32: DesignVoltage() */
-	return show_tp_ec_bat_u16(3, 4, 1, NULL, attr, buf);
+	int i, n;
+	char *p = buf;
+	struct bat_dump d;
+	int ret = read_bat_dump(attr_get_bat(attr), MAX_DUMP_ARG0, &d);
+	if (ret)
+		return ret;
+	for (n = 0; n < d.nrows; ++n) {
+		for (i = 0; i < TP_CONTROLLER_ROW_LEN; i++) {
+			if (d.valid[n] & (1 << i))
+				p += sprintf(p, "%02x ", d.row[n][i]);
+			else
+				p += sprintf(p, "-- "); /* unused by EC */
+		}
+		p += sprintf(p, "\n");
+	}
+	return p-buf;
 }
 
-static ssize_t show_battery_charging_max_voltage(
-	struct device *dev, struct device_attribute *attr, char *buf)
+/*
+ * The same dump in debugfs, under /sys/kernel/debug/tp_smapi/BAT?/ :
+ * "dump" is the text format above, and "dump_bin" is a sequence of
+ * struct tp_dump_record. Row 0x0b is included only if dump_row_0b is set.
+ */
+
+/* Binary dump record, as emitted by BAT?/dump_bin */
+struct tp_dump_record {
+	u8 arg0;
+	u8 bat;
+	__le16 valid;   /* bitmap of bytes actually set by the EC */
+	u8 val[TP_CONTROLLER_ROW_LEN];
+} __packed;
+
+static struct dentry *tp_debugfs_dir;
+static void tp_acpi_debugfs_init(struct dentry *dir);
+
+static int tp_debugfs_dump_show(struct seq_file *m, void *v)
 {
-	/* units: mV. SBS spec v1.1 p37,39: ChargingVoltage() */
-	return show_tp_ec_bat_u16(9, 8, 1, NULL, attr, buf);
+	int i, n;
+	struct bat_dump d;
+	int ret = read_bat_dump((long)m->private,
+				dump_row_0b ? MAX_DUMP_ARG0_EXT : MAX_DUMP_ARG0,
+				&d);
+	if (ret)
+		return ret;
+	for (n = 0; n < d.nrows; ++n) {
+		for (i = 0; i < TP_CONTROLLER_ROW_LEN; i++) {
+			if (d.valid[n] & (1 << i))
+				seq_printf(m, "%02x ", d.row[n][i]);
+			else
+				seq_puts(m, "-- ");
+		}
+		seq_putc(m, '\n');
+	}
+	return 0;
 }
 
-static ssize_t show_battery_group0_voltage(
-	struct device *dev, struct device_attribute *attr, char *buf)
+static int tp_debugfs_dump_bin_show(struct seq_file *m, void *v)
 {
-	/* units: mV */
-	return show_tp_ec_bat_u16(0xA, 12, 1, NULL, attr, buf);
+	int n;
+	struct bat_dump d;
+	struct tp_dump_record rec;
+	int bat = (long)m->private;
+	int ret = read_bat_dump(bat,
+				dump_row_0b ? MAX_DUMP_ARG0_EXT : MAX_DUMP_ARG0,
+				&d);
+	if (ret)
+		return ret;
+	for (n = 0; n < d.nrows; ++n) {
+		rec.arg0 = MIN_DUMP_ARG0 + n;
+		rec.bat = bat;
+		rec.valid = cpu_to_le16(d.valid[n]);
+		memcpy(rec.val, d.row[n], TP_CONTROLLER_ROW_LEN);
+		seq_write(m, &rec, sizeof(rec));
+	}
+	return 0;
 }
 
-static ssize_t show_battery_group1_voltage(
-	struct device *dev, struct device_attribute *attr, char *buf)
+/*
+ * BAT?/fields: all bat_fields[] at once, reading each needed row once.
+ * The battery status is checked once up front rather than per row.
+ */
+static int tp_debugfs_fields_show(struct seq_file *m, void *v)
 {
-	/* units: mV */
-	return show_tp_ec_bat_u16(0xA, 10, 1, NULL, attr, buf);
+	u8 rows[TP_CONTROLLER_ROW_LEN][TP_CONTROLLER_ROW_LEN];
+	u16 need = bat_fields_rows(bat_fields, ARRAY_SIZE(bat_fields));
+	struct tp_battery *b;
+	char buf[32];
+	int i, arg0, ret = 0;
+
+	mutex_lock(&tp_bats_mutex);
+	b = tp_bats[(long)m->private];
+	if (!b || bat_has_status(b->bat) != 1)
+		ret = -ENXIO;
+	for (arg0 = 0; arg0 < TP_CONTROLLER_ROW_LEN && !ret; ++arg0) {
+		if (!(need & (1 << arg0)))
+			continue;
+		if (arg0 < BAT_STATIC_MIN_ARG0 || arg0 > BAT_STATIC_MAX_ARG0)
+			ret = read_tp_ec_row(arg0, b->bat, 0, rows[arg0]);
+		else /* only checks the status again on a cache miss */
+			ret = get_tp_ec_bat_row(b, arg0, rows[arg0]);
+	}
+	mutex_unlock(&tp_bats_mutex);
+	if (ret)
+		return ret;
+	for (i = 0; i < ARRAY_SIZE(bat_fields); ++i) {
+		format_bat_field(&bat_fields[i], rows[bat_fields[i].arg0],
+				 buf, sizeof(buf));
+		seq_printf(m, "%s: %s", bat_fields[i].name, buf);
+	}
+	return 0;
 }
 
-static ssize_t show_battery_group2_voltage(
-	struct device *dev, struct device_attribute *attr, char *buf)
+static int tp_debugfs_dump_open(struct inode *inode, struct file *file)
 {
-	/* units: mV */
-	return show_tp_ec_bat_u16(0xA, 8, 1, NULL, attr, buf);
+	return single_open(file, tp_debugfs_dump_show, inode->i_private);
 }
 
-static ssize_t show_battery_group3_voltage(
-	struct device *dev, struct device_attribute *attr, char *buf)
+static int tp_debugfs_dump_bin_open(struct inode *inode, struct file *file)
 {
-	/* units: mV */
-	return show_tp_ec_bat_u16(0xA, 6, 1, NULL, attr, buf);
+	return single_open(file, tp_debugfs_dump_bin_show, inode->i_private);
 }
 
-static ssize_t show_battery_current_now(
-	struct device *dev, struct device_attribute *attr, char *buf)
+static int tp_debugfs_fields_open(struct inode *inode, struct file *file)
 {
- 	/* units: mA. SBS spec v1.1 p24: Current() */
-	return show_tp_ec_bat_s16(1, 8, 1, 0, attr, buf);
+	return single_open(file, tp_debugfs_fields_show, inode->i_private);
 }
 
-static ssize_t show_battery_current_avg(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: mA. SBS spec v1.1 p24: AverageCurrent() */
-	return show_tp_ec_bat_s16(1, 10, 1, 0, attr, buf);
+static const struct file_operations tp_debugfs_fields_fops = {
+	.owner = THIS_MODULE,
+	.open = tp_debugfs_fields_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations tp_debugfs_dump_fops = {
+	.owner = THIS_MODULE,
+	.open = tp_debugfs_dump_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations tp_debugfs_dump_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = tp_debugfs_dump_bin_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void __init tp_debugfs_init(void)
+{
+	static const char * const names[2] = { "BAT0", "BAT1" };
+	struct dentry *batdir;
+	long bat;
+
+	tp_debugfs_dir = debugfs_create_dir("tp_smapi", NULL);
+	if (IS_ERR_OR_NULL(tp_debugfs_dir))
+		return;
+	debugfs_create_bool("dump_row_0b", 0600, tp_debugfs_dir, &dump_row_0b);
+	tp_acpi_debugfs_init(tp_debugfs_dir);
+	for (bat = 0; bat < 2; ++bat) {
+		batdir = debugfs_create_dir(names[bat], tp_debugfs_dir);
+		debugfs_create_file("dump", 0400, batdir, (void *)bat,
+				    &tp_debugfs_dump_fops);
+		debugfs_create_file("dump_bin", 0400, batdir, (void *)bat,
+				    &tp_debugfs_dump_bin_fops);
+		debugfs_create_file("fields", 0400, batdir, (void *)bat,
+				    &tp_debugfs_fields_fops);
+	}
 }
 
-static ssize_t show_battery_charging_max_current(
-	struct device *dev, struct device_attribute *attr, char *buf)
+static void tp_debugfs_exit(void)
 {
-	/* units: mA. SBS spec v1.1 p36,38: ChargingCurrent() */
-	return show_tp_ec_bat_s16(9, 6, 1, 0, attr, buf);
-}
-
-static ssize_t show_battery_power_now(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: mW. SBS spec v1.1: Voltage()*Current() */
-	return show_tp_ec_bat_power(1, 6, 8, attr, buf);
-}
-
-static ssize_t show_battery_power_avg(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: mW. SBS spec v1.1: Voltage()*AverageCurrent() */
-	return show_tp_ec_bat_power(1, 6, 10, attr, buf);
-}
-
-static ssize_t show_battery_remaining_percent(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: percent. SBS spec v1.1 p25: RelativeStateOfCharge() */
-	return show_tp_ec_bat_u16(1, 12, 1, NULL, attr, buf);
-}
-
-static ssize_t show_battery_remaining_percent_error(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: percent. SBS spec v1.1 p25: MaxError() */
-	return show_tp_ec_bat_u16(9, 4, 1, NULL, attr, buf);
-}
-
-static ssize_t show_battery_remaining_charging_time(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: minutes. SBS spec v1.1 p27: AverageTimeToFull() */
-	return show_tp_ec_bat_u16(2, 8, 1, "not_charging", attr, buf);
-}
-
-static ssize_t show_battery_remaining_running_time(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: minutes. SBS spec v1.1 p27: RunTimeToEmpty() */
-	return show_tp_ec_bat_u16(2, 6, 1, "not_discharging", attr, buf);
-}
-
-static ssize_t show_battery_remaining_running_time_now(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: minutes. SBS spec v1.1 p27: RunTimeToEmpty() */
-	return show_tp_ec_bat_u16(2, 4, 1, "not_discharging", attr, buf);
-}
-
-static ssize_t show_battery_remaining_capacity(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: mWh. SBS spec v1.1 p26. */
-	return show_tp_ec_bat_u16(1, 14, 10, "", attr, buf);
-}
-
-static ssize_t show_battery_last_full_capacity(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: mWh. SBS spec v1.1 p26: FullChargeCapacity() */
-	return show_tp_ec_bat_u16(2, 2, 10, "", attr, buf);
-}
-
-static ssize_t show_battery_design_capacity(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: mWh. SBS spec v1.1 p32: DesignCapacity() */
-	return show_tp_ec_bat_u16(3, 2, 10, "", attr, buf);
-}
-
-static ssize_t show_battery_cycle_count(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: ordinal. SBS spec v1.1 p32: CycleCount() */
-	return show_tp_ec_bat_u16(2, 12, 1, "", attr, buf); 
-}
-
-static ssize_t show_battery_temperature(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* units: millicelsius. SBS spec v1.1: Temperature()*10 */
-	return show_tp_ec_bat_s16(1, 4, 100, -273100, attr, buf);
-}
-
-static ssize_t show_battery_serial(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* type: int. SBS spec v1.1 p34: SerialNumber() */
-	return show_tp_ec_bat_u16(3, 10, 1, "", attr, buf);
-}
-
-static ssize_t show_battery_manufacture_date(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* type: YYYY-MM-DD. SBS spec v1.1 p34: ManufactureDate() */
-	return show_tp_ec_bat_date(3, 8, attr, buf);
-}
-
-static ssize_t show_battery_first_use_date(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	/* type: YYYY-MM-DD */
-	return show_tp_ec_bat_date(8, 2, attr, buf);
-}
-
-/**
- * show_battery_dump - show the battery's dump attribute
- * The dump attribute gives a hex dump of all EC readouts related to a
- * battery. Some of the enumerated values don't really exist (i.e., the
- * EC function just leaves them untouched); we use a kludge to detect and
- * denote these.
- */
-#define MIN_DUMP_ARG0 0x00
-#define MAX_DUMP_ARG0 0x0a /* 0x0b is useful too but hangs old EC firmware */
-static ssize_t show_battery_dump(
-	struct device *dev, struct device_attribute *attr, char *buf)
-{
-	int i;
-	char *p = buf;
-	int bat = attr_get_bat(attr);
-	u8 arg0; /* first argument to EC */
-	u8 rowa[TP_CONTROLLER_ROW_LEN],
-	   rowb[TP_CONTROLLER_ROW_LEN];
-	const u8 junka = 0xAA,
-		 junkb = 0x55; /* junk values for testing changes */
-	int ret;
-
-	for (arg0 = MIN_DUMP_ARG0; arg0 <= MAX_DUMP_ARG0; ++arg0) {
-		if ((p-buf) > PAGE_SIZE-TP_CONTROLLER_ROW_LEN*5)
-			return -ENOMEM; /* don't overflow sysfs buf */
-		/* Read raw twice with different junk values,
-		 * to detect unused output bytes which are left unchaged: */
-		ret = read_tp_ec_row(arg0, bat, junka, rowa);
-		if (ret)
-			return ret;
-		ret = read_tp_ec_row(arg0, bat, junkb, rowb);
-		if (ret)
-			return ret;
-		for (i = 0; i < TP_CONTROLLER_ROW_LEN; i++) {
-			if (rowa[i] == junka && rowb[i] == junkb)
-				p += sprintf(p, "-- "); /* unused by EC */
-			else
-				p += sprintf(p, "%02x ", rowa[i]);
-		}
-		p += sprintf(p, "\n");
-	}
-	return p-buf;
+	debugfs_remove_recursive(tp_debugfs_dir);
+	tp_debugfs_dir = NULL;
 }
 
 
@@ -1223,6 +1575,10 @@ static ssize_t store_smapi_request(struct device *dev,
 	ret = smapi_request(
 		   inEBX, inECX, inEDI, inESI,
 		   &outEBX, &outECX, &outEDX, &outEDI, &outESI, &msg);
+	/* It may have been a write; don't trust what we cached */
+	tp_power_cache_invalidate();
+	forget_known_settings(0);
+	forget_known_settings(1);
 	snprintf(smapi_attr_answer, MAX_SMAPI_ATTR_ANSWER_LEN,
 		 "%x %x %x %x %x %d '%s'\n",
 		 (unsigned int)outEBX, (unsigned int)outECX,
@@ -1242,10 +1598,15 @@ static ssize_t store_smapi_request(struct device *dev,
 
 static int saved_threshs[4] = {-1, -1, -1, -1};  /* -1 = don't know */
 
+static void tp_monitor_kick(int revalidate);
+static void tp_monitor_suspend(void);
+static void tp_monitor_resume(void);
+
 static int tp_suspend(struct platform_device *dev, pm_message_t state)
 {
 	int restore = (state.event == PM_EVENT_HIBERNATE ||
 	               state.event == PM_EVENT_FREEZE);
+	tp_monitor_suspend();
 	if (!restore || get_real_thresh(0, THRESH_STOP , &saved_threshs[0]))
 		saved_threshs[0] = -1;
 	if (!restore || get_real_thresh(0, THRESH_START, &saved_threshs[1]))
@@ -1261,6 +1622,8 @@ static int tp_suspend(struct platform_device *dev, pm_message_t state)
 
 static int tp_resume(struct platform_device *dev)
 {
+	forget_known_settings(0);
+	forget_known_settings(1);
 	DPRINTK("resume restoring: %d %d %d %d", saved_threshs[0],
 		saved_threshs[1], saved_threshs[2], saved_threshs[3]);
 	if (saved_threshs[0] >= 0)
@@ -1271,6 +1634,7 @@ static int tp_resume(struct platform_device *dev)
 		set_real_thresh(1, THRESH_STOP , saved_threshs[2]);
 	if (saved_threshs[3] >= 0)
 		set_real_thresh(1, THRESH_START, saved_threshs[3]);
+	tp_monitor_resume();
 	return 0;
 }
 
@@ -1295,13 +1659,29 @@ static struct platform_driver tp_driver = {
 
 /* Attributes in /sys/devices/platform/smapi/ */
 
+static ssize_t show_poll_interval_ms(
+	struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t show_poll_reason(
+	struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t show_charge_policy(
+	struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t store_charge_policy(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count);
+
 static DEVICE_ATTR(ac_connected, 0444, show_ac_connected, NULL);
 static DEVICE_ATTR(smapi_request, 0600, show_smapi_request,
 					store_smapi_request);
+static DEVICE_ATTR(poll_interval_ms, 0444, show_poll_interval_ms, NULL);
+static DEVICE_ATTR(poll_reason, 0444, show_poll_reason, NULL);
+static DEVICE_ATTR(charge_policy, 0644, show_charge_policy,
+					store_charge_policy);
 
 static struct attribute *tp_root_attributes[] = {
 	&dev_attr_ac_connected.attr,
 	&dev_attr_smapi_request.attr,
+	&dev_attr_poll_interval_ms.attr,
+	&dev_attr_poll_reason.attr,
+	&dev_attr_charge_policy.attr,
 	NULL
 };
 static struct attribute_group tp_root_attribute_group = {
@@ -1309,179 +1689,1558 @@ static struct attribute_group tp_root_attribute_group = {
 };
 
 /* Attributes under /sys/devices/platform/smapi/BAT{0,1}/ :
- * Every attribute needs to be defined (i.e., statically allocated) for
- * each battery, and then referenced in the attribute list of each battery.
- * We use preprocessor voodoo to avoid duplicating the list of attributes 4
- * times. The preprocessor output is just normal sysfs attributes code.
+ * These are instantiated for each battery object, see tp_battery_add(),
+ * together with one read-only attribute for each entry of bat_fields[].
  */
 
-/**
- * FOREACH_BAT_ATTR - invoke the given macros on all our battery attributes
- * @_BAT:     battery number (0 or 1)
- * @_ATTR_RW: macro to invoke for each read/write attribute
- * @_ATTR_R:  macro to invoke for each read-only  attribute
- */
-#define FOREACH_BAT_ATTR(_BAT, _ATTR_RW, _ATTR_R) \
-	_ATTR_RW(_BAT, start_charge_thresh) \
-	_ATTR_RW(_BAT, stop_charge_thresh) \
-	_ATTR_RW(_BAT, inhibit_charge_minutes) \
-	_ATTR_RW(_BAT, force_discharge) \
-	_ATTR_R(_BAT, installed) \
-	_ATTR_R(_BAT, state) \
-	_ATTR_R(_BAT, manufacturer) \
-	_ATTR_R(_BAT, model) \
-	_ATTR_R(_BAT, barcoding) \
-	_ATTR_R(_BAT, chemistry) \
-	_ATTR_R(_BAT, voltage) \
-	_ATTR_R(_BAT, group0_voltage) \
-	_ATTR_R(_BAT, group1_voltage) \
-	_ATTR_R(_BAT, group2_voltage) \
-	_ATTR_R(_BAT, group3_voltage) \
-	_ATTR_R(_BAT, current_now) \
-	_ATTR_R(_BAT, current_avg) \
-	_ATTR_R(_BAT, charging_max_current) \
-	_ATTR_R(_BAT, power_now) \
-	_ATTR_R(_BAT, power_avg) \
-	_ATTR_R(_BAT, remaining_percent) \
-	_ATTR_R(_BAT, remaining_percent_error) \
-	_ATTR_R(_BAT, remaining_charging_time) \
-	_ATTR_R(_BAT, remaining_running_time) \
-	_ATTR_R(_BAT, remaining_running_time_now) \
-	_ATTR_R(_BAT, remaining_capacity) \
-	_ATTR_R(_BAT, last_full_capacity) \
-	_ATTR_R(_BAT, design_voltage) \
-	_ATTR_R(_BAT, charging_max_voltage) \
-	_ATTR_R(_BAT, design_capacity) \
-	_ATTR_R(_BAT, cycle_count) \
-	_ATTR_R(_BAT, temperature) \
-	_ATTR_R(_BAT, serial) \
-	_ATTR_R(_BAT, manufacture_date) \
-	_ATTR_R(_BAT, first_use_date) \
-	_ATTR_R(_BAT, dump)
-
-/* Define several macros we will feed into FOREACH_BAT_ATTR: */
-
-#define DEFINE_BAT_ATTR_RW(_BAT,_NAME) \
-	static struct bat_device_attribute dev_attr_##_NAME##_##_BAT = {  \
-		.dev_attr = __ATTR(_NAME, 0644, show_battery_##_NAME,   \
-						store_battery_##_NAME), \
-		.bat = _BAT \
-	};
-
-#define DEFINE_BAT_ATTR_R(_BAT,_NAME) \
-	static struct bat_device_attribute dev_attr_##_NAME##_##_BAT = {    \
-		.dev_attr = __ATTR(_NAME, 0644, show_battery_##_NAME, 0), \
-		.bat = _BAT \
-	};
-
-#define REF_BAT_ATTR(_BAT,_NAME) \
-	&dev_attr_##_NAME##_##_BAT.dev_attr.attr,
-
-/* This provide all attributes for one battery: */
-
-#define PROVIDE_BAT_ATTRS(_BAT) \
-	FOREACH_BAT_ATTR(_BAT, DEFINE_BAT_ATTR_RW, DEFINE_BAT_ATTR_R) \
-	static struct attribute *tp_bat##_BAT##_attributes[] = { \
-		FOREACH_BAT_ATTR(_BAT, REF_BAT_ATTR, REF_BAT_ATTR) \
-		NULL \
-	}; \
-	static struct attribute_group tp_bat##_BAT##_attribute_group = { \
-		.name  = "BAT" #_BAT, \
-		.attrs = tp_bat##_BAT##_attributes \
-	};
-
-/* Finally genereate the attributes: */
-
-PROVIDE_BAT_ATTRS(0)
-PROVIDE_BAT_ATTRS(1)
-
-/* List of attribute groups */
-
-static struct attribute_group *attr_groups[] = {
-	&tp_root_attribute_group,
-	&tp_bat0_attribute_group,
-	&tp_bat1_attribute_group,
-	NULL
+struct bat_attr_desc {
+	const char *name;
+	umode_t mode;
+	ssize_t (*show)(struct device *dev, struct device_attribute *attr,
+			char *buf);
+	ssize_t (*store)(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count);
+};
+
+#define BAT_ATTR_RW(_NAME) \
+	{ #_NAME, 0644, show_battery_##_NAME, store_battery_##_NAME }
+#define BAT_ATTR_R(_NAME) \
+	{ #_NAME, 0444, show_battery_##_NAME, NULL }
+
+static const struct bat_attr_desc bat_attr_descs[] = {
+	BAT_ATTR_RW(start_charge_thresh),
+	BAT_ATTR_RW(stop_charge_thresh),
+	BAT_ATTR_RW(inhibit_charge_minutes),
+	BAT_ATTR_RW(force_discharge),
+	BAT_ATTR_R(installed),
+	BAT_ATTR_R(state),
+	BAT_ATTR_R(dump),
 };
 
 
 /*********************************************************************
- * Init and cleanup
+ * hwmon devices for battery temperature, voltage and current, so that
+ * lm-sensors and similar tools pick them up. Reads go through the
+ * rate-limited battery status cache.
  */
 
-static struct attribute_group **next_attr_group; /* next to register */
+#if IS_REACHABLE(CONFIG_HWMON) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
 
-static int __init tp_init(void)
+static umode_t tp_hwmon_is_visible(const void *data,
+				   enum hwmon_sensor_types type,
+				   u32 attr, int channel)
 {
-	int ret;
-	printk(KERN_INFO "tp_smapi " TP_VERSION " loading...\n");
+	return 0444;
+}
 
-	ret = find_smapi_port();
-	if (ret < 0)
-		goto err;
-	else
-		smapi_port = ret;
+static int tp_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+			 u32 attr, int channel, long *val)
+{
+	u8 row[TP_CONTROLLER_ROW_LEN];
+	struct tp_battery *b = dev_get_drvdata(dev);
+	int ret = read_bat_status_cached(b, row, status_cache_ms);
+	if (ret)
+		return ret;
+	switch (type) {
+	case hwmon_temp: /* millicelsius. SBS spec v1.1: Temperature()*10 */
+		*val = 100 * (long)*(s16 *)(row+4) - 273100;
+		break;
+	case hwmon_in:   /* mV. SBS spec v1.1 p24: Voltage() */
+		*val = *(u16 *)(row+6);
+		break;
+	case hwmon_curr: /* mA. SBS spec v1.1 p24: Current() */
+		*val = *(s16 *)(row+8);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+	return 0;
+}
 
-	if (!request_region(smapi_port, 1, "smapi")) {
-		printk(KERN_ERR "tp_smapi cannot claim port 0x%x\n",
-		       smapi_port);
-		ret = -ENXIO;
-		goto err;
+static const u32 tp_hwmon_temp_config[] = { HWMON_T_INPUT, 0 };
+static const u32 tp_hwmon_in_config[] = { HWMON_I_INPUT, 0 };
+static const u32 tp_hwmon_curr_config[] = { HWMON_C_INPUT, 0 };
+
+static const struct hwmon_channel_info tp_hwmon_temp = {
+	.type = hwmon_temp, .config = tp_hwmon_temp_config };
+static const struct hwmon_channel_info tp_hwmon_in = {
+	.type = hwmon_in, .config = tp_hwmon_in_config };
+static const struct hwmon_channel_info tp_hwmon_curr = {
+	.type = hwmon_curr, .config = tp_hwmon_curr_config };
+
+static const struct hwmon_channel_info *tp_hwmon_info[] = {
+	&tp_hwmon_temp,
+	&tp_hwmon_in,
+	&tp_hwmon_curr,
+	NULL
+};
+
+static const struct hwmon_ops tp_hwmon_ops = {
+	.is_visible = tp_hwmon_is_visible,
+	.read = tp_hwmon_read,
+};
+
+static const struct hwmon_chip_info tp_hwmon_chip_info = {
+	.ops = &tp_hwmon_ops,
+	.info = tp_hwmon_info,
+};
+
+static void tp_hwmon_register(struct tp_battery *b)
+{
+	static const char * const names[TP_MAX_BATS] =
+		{ "smapi_bat0", "smapi_bat1" };
+	struct device *hwdev = hwmon_device_register_with_info(
+		&pdev->dev, names[b->bat], b, &tp_hwmon_chip_info, NULL);
+	if (IS_ERR(hwdev)) {
+		TPRINTK(KERN_WARNING, "cannot register hwmon for bat=%d "
+			"(ret=%ld)", b->bat, PTR_ERR(hwdev));
+		return;
 	}
+	b->hwmon_dev = hwdev;
+}
 
-	if (!request_region(SMAPI_PORT2, 1, "smapi")) {
-		printk(KERN_ERR "tp_smapi cannot claim port 0x%x\n",
-		       SMAPI_PORT2);
-		ret = -ENXIO;
-		goto err_port1;
+static void tp_hwmon_unregister(struct tp_battery *b)
+{
+	if (b->hwmon_dev)
+		hwmon_device_unregister(b->hwmon_dev);
+	b->hwmon_dev = NULL;
+}
+
+#else /* CONFIG_HWMON */
+
+static inline void tp_hwmon_register(struct tp_battery *b) {}
+static inline void tp_hwmon_unregister(struct tp_battery *b) {}
+
+#endif /* CONFIG_HWMON */
+
+
+/*********************************************************************
+ * Creation and removal of battery objects
+ */
+
+/**
+ * tp_battery_add - create the object and sysfs group of a battery
+ * @bat: battery number
+ */
+static int tp_battery_add(int bat)
+{
+	const int ndescs = ARRAY_SIZE(bat_attr_descs);
+	const int n = ndescs + ARRAY_SIZE(bat_fields);
+	struct tp_battery *b;
+	int i, ret;
+
+	b = kzalloc(sizeof(*b) + n*sizeof(b->dev_attrs[0]) +
+		    (n+1)*sizeof(b->attrs[0]), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	b->bat = bat;
+	snprintf(b->name, sizeof(b->name), "BAT%d", bat);
+	mutex_init(&b->status_lock);
+	mutex_init(&b->static_lock);
+	b->attrs = (struct attribute **)&b->dev_attrs[n];
+	for (i = 0; i < n; ++i) {
+		struct device_attribute *da = &b->dev_attrs[i].dev_attr;
+		sysfs_attr_init(&da->attr);
+		if (i < ndescs) {
+			da->attr.name = bat_attr_descs[i].name;
+			da->attr.mode = bat_attr_descs[i].mode;
+			da->show = bat_attr_descs[i].show;
+			da->store = bat_attr_descs[i].store;
+		} else {
+			b->dev_attrs[i].field = &bat_fields[i-ndescs];
+			da->attr.name = bat_fields[i-ndescs].name;
+			da->attr.mode = 0444;
+			da->show = show_battery_field;
+		}
+		b->dev_attrs[i].battery = b;
+		b->attrs[i] = &da->attr;
 	}
+	b->attrs[n] = NULL;
+	b->group.name = b->name;
+	b->group.attrs = b->attrs;
 
-	ret = platform_driver_register(&tp_driver);
-	if (ret)
-		goto err_port2;
+	ret = sysfs_create_group(&pdev->dev.kobj, &b->group);
+	if (ret) {
+		kfree(b);
+		return ret;
+	}
+	tp_hwmon_register(b);
+	tp_bats[bat] = b;
+	DPRINTK("added %s", b->name);
+	return 0;
+}
 
-	pdev = platform_device_alloc("smapi", -1);
-	if (!pdev) {
-		ret = -ENOMEM;
-		goto err_driver;
+/**
+ * tp_battery_remove - remove the object and sysfs group of a battery
+ * @bat: battery number
+ */
+static void tp_battery_remove(int bat)
+{
+	struct tp_battery *b = tp_bats[bat];
+	if (!b)
+		return;
+	tp_bats[bat] = NULL;
+	tp_hwmon_unregister(b);
+	sysfs_remove_group(&pdev->dev.kobj, &b->group);
+	DPRINTK("removed %s", b->name);
+	kfree(b);
+}
+
+
+/*********************************************************************
+ * Generic netlink: battery and AC events are multicast on the "events"
+ * group of the "tp_smapi" family (see tp_smapi.h), so that daemons need
+ * not poll sysfs. Transitions are detected by the hotplug monitor below.
+ * A listener may also ask for a periodic summary of all batteries with
+ * TP_SMAPI_CMD_SET_SUMMARY_INTERVAL. Requests are tracked per netlink
+ * socket until it is closed, and summaries are sent at the shortest
+ * interval requested.
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+
+#define TP_GENL_MIN_SUMMARY_MS 100
+/* Enough for the largest message, a summary of all batteries */
+#define TP_GENL_MSG_SIZE (nla_total_size(sizeof(u8)) + TP_MAX_BATS * \
+			  nla_total_size(sizeof(struct tp_smapi_bat_summary)))
+
+static struct genl_family tp_genl_family;
+static int tp_genl_registered;
+static unsigned int tp_genl_summary_ms; /* 0 = no periodic summary */
+static u8 tp_genl_state[TP_MAX_BATS];   /* last reported battery states */
+
+/* A listener's requested summary interval */
+struct tp_genl_sub {
+	struct list_head list;
+	u32 portid;
+	unsigned int ms;
+};
+static LIST_HEAD(tp_genl_subs);
+static DEFINE_MUTEX(tp_genl_subs_mutex); /* protects tp_genl_subs */
+
+static void tp_genl_summary(struct work_struct *work);
+static DECLARE_DELAYED_WORK(tp_genl_summary_work, tp_genl_summary);
+
+static int tp_genl_listening(void)
+{
+	return tp_genl_registered &&
+	       genl_has_listeners(&tp_genl_family, &init_net, 0);
+}
+
+static struct sk_buff *tp_genl_new(u8 cmd, void **hdr)
+{
+	struct sk_buff *skb = genlmsg_new(TP_GENL_MSG_SIZE, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+	*hdr = genlmsg_put(skb, 0, 0, &tp_genl_family, 0, cmd);
+	if (!*hdr) {
+		nlmsg_free(skb);
+		return NULL;
 	}
+	return skb;
+}
 
-	ret = platform_device_add(pdev);
-	if (ret)
-		goto err_device_free;
+static void tp_genl_send(struct sk_buff *skb, void *hdr)
+{
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&tp_genl_family, skb, 0, 0, GFP_KERNEL);
+}
+
+/**
+ * tp_genl_event - multicast an event with a single u8 value
+ * @cmd: TP_SMAPI_CMD_* event type
+ * @bat: battery number, or -1 for events not specific to a battery
+ * @attr: TP_SMAPI_A_* attribute carrying @value
+ */
+static void tp_genl_event(u8 cmd, int bat, int attr, u8 value)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!tp_genl_listening())
+		return;
+	skb = tp_genl_new(cmd, &hdr);
+	if (!skb)
+		return;
+	if ((bat >= 0 && nla_put_u8(skb, TP_SMAPI_A_BAT, bat)) ||
+	    nla_put_u8(skb, attr, value)) {
+		nlmsg_free(skb);
+		return;
+	}
+	tp_genl_send(skb, hdr);
+}
+
+static void tp_genl_thresh_event(int bat, enum thresh_type which, int thresh)
+{
+	tp_genl_event(TP_SMAPI_CMD_THRESH, bat,
+		      (which == THRESH_START) ? TP_SMAPI_A_THRESH_START
+					      : TP_SMAPI_A_THRESH_STOP,
+		      thresh);
+}
+
+static int tp_genl_put_summary(struct sk_buff *skb, int bat, const u8 *row)
+{
+	struct tp_smapi_bat_summary s;
+
+	memset(&s, 0, sizeof(s));
+	s.bat = bat;
+	s.state = bat_state_from_row(bat, row);
+	s.remaining_percent = row[12];
+	s.current_now = (s16)(row[8] | (row[9] << 8));
+	s.voltage = row[6] | (row[7] << 8);
+	s.power_now = (s32)s.current_now * s.voltage / 1000;
+	s.remaining_capacity = (row[14] | (row[15] << 8)) * 10;
+	return nla_put(skb, TP_SMAPI_A_SUMMARY, sizeof(s), &s);
+}
 
-	for (next_attr_group = attr_groups; *next_attr_group;
-	     ++next_attr_group) {
-		ret = sysfs_create_group(&pdev->dev.kobj, *next_attr_group);
+static void tp_genl_summary(struct work_struct *work)
+{
+	u8 row[TP_CONTROLLER_ROW_LEN];
+	struct sk_buff *skb;
+	void *hdr;
+	int bat, ret;
+
+	/* The monitor restarts us once somebody listens again */
+	if (!tp_genl_summary_ms || !tp_genl_listening())
+		return;
+
+	skb = tp_genl_new(TP_SMAPI_CMD_SUMMARY, &hdr);
+	if (skb) {
+		ret = power_device_present(0xFF);
+		ret = (ret < 0) ? ret : nla_put_u8(skb, TP_SMAPI_A_AC, ret);
+		mutex_lock(&tp_bats_mutex);
+		for (bat = 0; bat < TP_MAX_BATS && !ret; ++bat)
+			if (tp_bats[bat] &&
+			    !read_bat_status_cached(tp_bats[bat], row,
+						    tp_genl_summary_ms))
+				ret = tp_genl_put_summary(skb, bat, row);
+		mutex_unlock(&tp_bats_mutex);
 		if (ret)
-			goto err_attr;
+			nlmsg_free(skb);
+		else
+			tp_genl_send(skb, hdr);
 	}
 
-	printk(KERN_INFO "tp_smapi successfully loaded (smapi_port=0x%x).\n",
-	       smapi_port);
-	return 0;
+	queue_delayed_work(system_freezable_wq, &tp_genl_summary_work,
+			   msecs_to_jiffies(tp_genl_summary_ms));
+}
 
-err_attr:
-	while (--next_attr_group >= attr_groups)
-		sysfs_remove_group(&pdev->dev.kobj, *next_attr_group);
-	platform_device_unregister(pdev);
-err_device_free:
-	platform_device_put(pdev);
-err_driver:
-	platform_driver_unregister(&tp_driver);
-err_port2:
-	release_region(SMAPI_PORT2, 1);
-err_port1:
-	release_region(smapi_port, 1);
-err:
-	printk(KERN_ERR "tp_smapi init failed (ret=%d)!\n", ret);
+/**
+ * tp_genl_monitor - report battery state transitions
+ * @rows: EC row 0x01 of each battery, as read by the hotplug monitor
+ * States are only tracked while somebody listens, so a new listener gets
+ * the current state of each battery as an initial event.
+ */
+static void tp_genl_monitor(u8 rows[][TP_CONTROLLER_ROW_LEN])
+{
+	u8 state;
+	int bat;
+
+	if (!tp_genl_listening()) {
+		memset(tp_genl_state, TP_SMAPI_BAT_NONE, sizeof(tp_genl_state));
+		return;
+	}
+
+	for (bat = 0; bat < TP_MAX_BATS; ++bat) {
+		state = bat_state_from_row(bat, rows[bat]);
+		if (state == tp_genl_state[bat])
+			continue;
+		tp_genl_state[bat] = state;
+		tp_genl_event(TP_SMAPI_CMD_BAT_STATE, bat,
+			      TP_SMAPI_A_STATE, state);
+	}
+
+	if (tp_genl_summary_ms && !delayed_work_pending(&tp_genl_summary_work))
+		queue_delayed_work(system_freezable_wq, &tp_genl_summary_work,
+				   0);
+}
+
+/**
+ * tp_genl_subscribe - set a listener's summary interval
+ * @portid: netlink port of the listener
+ * @ms: requested interval, 0 to drop the request
+ * Recomputes the summary interval as the minimum over all listeners.
+ */
+static int tp_genl_subscribe(u32 portid, unsigned int ms)
+{
+	struct tp_genl_sub *sub, *found = NULL;
+	unsigned int min_ms = 0;
+	int ret = 0;
+
+	mutex_lock(&tp_genl_subs_mutex);
+	list_for_each_entry(sub, &tp_genl_subs, list)
+		if (sub->portid == portid)
+			found = sub;
+	if (!ms && found) {
+		list_del(&found->list);
+		kfree(found);
+	} else if (ms && !found) {
+		found = kzalloc(sizeof(*found), GFP_KERNEL);
+		if (found) {
+			found->portid = portid;
+			list_add(&found->list, &tp_genl_subs);
+		} else {
+			ret = -ENOMEM;
+		}
+	}
+	if (ms && found)
+		found->ms = ms;
+
+	list_for_each_entry(sub, &tp_genl_subs, list)
+		if (!min_ms || sub->ms < min_ms)
+			min_ms = sub->ms;
+	tp_genl_summary_ms = min_ms;
+	if (min_ms)
+		mod_delayed_work(system_freezable_wq, &tp_genl_summary_work, 0);
+	else
+		cancel_delayed_work(&tp_genl_summary_work);
+	mutex_unlock(&tp_genl_subs_mutex);
 	return ret;
 }
 
-static void __exit tp_exit(void)
+static int tp_genl_set_summary_interval(struct sk_buff *skb,
+					struct genl_info *info)
+{
+	u32 ms;
+	int ret;
+
+	if (!info->attrs[TP_SMAPI_A_INTERVAL_MS])
+		return -EINVAL;
+	ms = nla_get_u32(info->attrs[TP_SMAPI_A_INTERVAL_MS]);
+	if (ms && ms < TP_GENL_MIN_SUMMARY_MS)
+		ms = TP_GENL_MIN_SUMMARY_MS;
+	ret = tp_genl_subscribe(info->snd_portid, ms);
+	tp_monitor_kick(0); /* let the poll governor see the new listener */
+	return ret;
+}
+
+/* Drop the summary request of a listener whose socket went away */
+static int tp_genl_netlink_notify(struct notifier_block *nb,
+				  unsigned long state, void *data)
+{
+	struct netlink_notify *n = data;
+
+	if (state == NETLINK_URELEASE && n->protocol == NETLINK_GENERIC &&
+	    net_eq(n->net, &init_net))
+		tp_genl_subscribe(n->portid, 0);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block tp_genl_netlink_nb = {
+	.notifier_call = tp_genl_netlink_notify,
+};
+
+static const struct nla_policy tp_genl_policy[TP_SMAPI_A_MAX + 1] = {
+	[TP_SMAPI_A_INTERVAL_MS] = { .type = NLA_U32 },
+};
+
+static const struct genl_ops tp_genl_ops[] = {
+	{
+		.cmd = TP_SMAPI_CMD_SET_SUMMARY_INTERVAL,
+		.doit = tp_genl_set_summary_interval,
+		.flags = GENL_ADMIN_PERM,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+		.policy = tp_genl_policy,
+#endif
+	},
+};
+
+static const struct genl_multicast_group tp_genl_mcgrps[] = {
+	{ .name = TP_SMAPI_GENL_MCGRP },
+};
+
+static struct genl_family tp_genl_family = {
+	.name = TP_SMAPI_GENL_NAME,
+	.version = TP_SMAPI_GENL_VERSION,
+	.maxattr = TP_SMAPI_A_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+	.policy = tp_genl_policy,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+	.resv_start_op = __TP_SMAPI_CMD_MAX,
+#endif
+	.module = THIS_MODULE,
+	.ops = tp_genl_ops,
+	.n_ops = ARRAY_SIZE(tp_genl_ops),
+	.mcgrps = tp_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(tp_genl_mcgrps),
+};
+
+static void __init tp_genl_init(void)
 {
-	while (next_attr_group && --next_attr_group >= attr_groups)
-		sysfs_remove_group(&pdev->dev.kobj, *next_attr_group);
+	int ret = genl_register_family(&tp_genl_family);
+	if (ret) {
+		TPRINTK(KERN_NOTICE, "cannot register netlink family (%d)", ret);
+		return;
+	}
+	netlink_register_notifier(&tp_genl_netlink_nb);
+	tp_genl_registered = 1;
+}
+
+static void tp_genl_exit(void)
+{
+	struct tp_genl_sub *sub, *tmp;
+
+	if (!tp_genl_registered)
+		return;
+	tp_genl_registered = 0;
+	genl_unregister_family(&tp_genl_family);
+	netlink_unregister_notifier(&tp_genl_netlink_nb);
+	cancel_delayed_work_sync(&tp_genl_summary_work);
+	list_for_each_entry_safe(sub, tmp, &tp_genl_subs, list) {
+		list_del(&sub->list);
+		kfree(sub);
+	}
+}
+
+#else /* no static genl families */
+
+static inline int tp_genl_listening(void) { return 0; }
+static inline void tp_genl_event(u8 cmd, int bat, int attr, u8 value) {}
+static inline void tp_genl_thresh_event(int bat, enum thresh_type which,
+					int thresh) {}
+static inline void tp_genl_monitor(u8 rows[][TP_CONTROLLER_ROW_LEN]) {}
+static inline void tp_genl_init(void) {}
+static inline void tp_genl_exit(void) {}
+
+#endif /* LINUX_VERSION_CODE >= 4.10 */
+
+
+/*********************************************************************
+ * Charge policy: a small rule table, written to the charge_policy
+ * attribute, which the driver applies by itself whenever the battery
+ * monitor samples the AC and battery state:
+ *   <bat> ac <start> <stop>               thresholds normally
+ *   <bat> battery <hours> <start> <stop>  thresholds once on battery for
+ *                                         <hours>, until charged again
+ *   <bat> calibrate                       on AC, force discharging until
+ *                                         empty; then the rule is dropped
+ * Settings are only written when they differ from what was last written,
+ * so a steady state costs no SMIs and no extra wakeups.
+ */
+
+#define TP_POLICY_MAX_RULES 8
+
+enum tp_policy_kind {
+	TP_POLICY_AC,
+	TP_POLICY_BATTERY,
+	TP_POLICY_CALIBRATE,
+};
+
+struct tp_policy_rule {
+	u8 bat;
+	u8 kind;            /* enum tp_policy_kind */
+	u8 start, stop;     /* thresholds, for TP_POLICY_AC and _BATTERY */
+	unsigned int hours; /* for TP_POLICY_BATTERY */
+};
+
+static struct tp_policy_rule tp_policy[TP_POLICY_MAX_RULES];
+static int tp_policy_len;
+static DEFINE_MUTEX(tp_policy_mutex);
+static u64 tp_policy_battery_since; /* boottime (ns) AC went away, 0=on AC */
+static u8 tp_policy_latched;        /* batteries under their battery rule */
+static u8 tp_policy_calibrating;    /* batteries seen force-discharging */
+static u8 tp_policy_discharging;    /* batteries we forced to discharge */
+static int tp_policy_watch;         /* need battery status every sample? */
+
+/* Wake up the monitor when a battery rule's period is over */
+static void tp_policy_timeout(struct work_struct *work)
+{
+	tp_monitor_kick(0);
+}
+static DECLARE_DELAYED_WORK(tp_policy_work, tp_policy_timeout);
+
+static struct tp_policy_rule *tp_policy_find(int bat, int kind)
+{
+	int i;
+	for (i = 0; i < tp_policy_len; ++i)
+		if (tp_policy[i].bat == bat && tp_policy[i].kind == kind)
+			return &tp_policy[i];
+	return NULL;
+}
+
+/* Write a threshold unless already written, or failed before. Caller
+ * must hold smapi_mutex. */
+static void tp_policy_write_thresh(int bat, enum thresh_type which,
+				   int thresh, int real)
+{
+	if (known_thresh[bat][which] == real ||
+	    failed_thresh[bat][which] == real)
+		return;
+	if (set_thresh(bat, which, thresh))
+		failed_thresh[bat][which] = real;
+}
+
+/**
+ * tp_policy_set_thresh - write only the thresholds that need changing
+ * Raising the start threshold writes the stop threshold first, and
+ * lowering it writes the start threshold first, so start stays below stop.
+ */
+static void tp_policy_set_thresh(int bat, int start, int stop)
+{
+	int real_start = thresh_to_real(THRESH_START, start);
+	int real_stop = thresh_to_real(THRESH_STOP, stop);
+
+	down(&smapi_mutex);
+	if (real_start > known_thresh[bat][THRESH_START])
+		tp_policy_write_thresh(bat, THRESH_STOP, stop, real_stop);
+	tp_policy_write_thresh(bat, THRESH_START, start, real_start);
+	tp_policy_write_thresh(bat, THRESH_STOP, stop, real_stop);
+	up(&smapi_mutex);
+}
+
+static void tp_policy_set_discharge(int bat, int enabled)
+{
+	if (enabled)
+		tp_policy_discharging |= 1 << bat;
+	else if (tp_policy_discharging & (1 << bat))
+		tp_policy_discharging &= ~(1 << bat);
+	else
+		return; /* not ours to reset */
+	down(&smapi_mutex);
+	if (known_force_discharge[bat] != enabled &&
+	    failed_force_discharge[bat] != enabled &&
+	    set_force_discharge(bat, enabled))
+		failed_force_discharge[bat] = enabled;
+	up(&smapi_mutex);
+}
+
+/**
+ * tp_policy_calibration - decide whether to force a battery to discharge
+ * Returns 1 to discharge. Calibration is done once the EC stops a forced
+ * discharge on its own, or the battery reports no charge left.
+ */
+static int tp_policy_calibration(int bat, int on_ac, u8 state, int percent)
+{
+	struct tp_policy_rule *r = tp_policy_find(bat, TP_POLICY_CALIBRATE);
+	u8 bit = 1 << bat;
+
+	if (!r || !on_ac || state == TP_SMAPI_BAT_NONE) {
+		tp_policy_calibrating &= ~bit;
+		return r && on_ac; /* keep discharging if the row wasn't read */
+	}
+	if (state == TP_SMAPI_BAT_DISCHARGING && percent > 0) {
+		tp_policy_calibrating |= bit;
+		return 1;
+	}
+	if (!(tp_policy_calibrating & bit) && percent > 0)
+		return 1; /* not discharging yet */
+
+	TPRINTK(KERN_INFO, "BAT%d calibration discharge finished", bat);
+	tp_policy_calibrating &= ~bit;
+	memmove(r, r + 1, (tp_policy + tp_policy_len - (r + 1)) * sizeof(*r));
+	--tp_policy_len;
+	return 0;
+}
+
+/**
+ * tp_policy_eval - apply the charge policy to the current power state
+ * @present: presence bits from EC row 0x01
+ * @rows: EC row 0x01 of each battery (zeroed if not read)
+ * Called by the battery monitor after each sample.
+ */
+static void tp_policy_eval(u8 present, u8 rows[][TP_CONTROLLER_ROW_LEN])
+{
+	struct tp_policy_rule *r;
+	int on_ac = !!(present & EC_PRESENT_AC);
+	u64 now = ktime_to_ns(ktime_get_boottime());
+	u64 due, next = 0;
+	int bat, percent, watch = 0;
+	u8 state, bit;
+
+	mutex_lock(&tp_policy_mutex);
+	if (on_ac)
+		tp_policy_battery_since = 0;
+	else if (!tp_policy_battery_since)
+		tp_policy_battery_since = now;
+
+	for (bat = 0; bat < TP_MAX_BATS; ++bat) {
+		bit = 1 << bat;
+		if (!(present & EC_PRESENT_BAT(bat))) {
+			tp_policy_latched &= ~bit;
+			tp_policy_calibrating &= ~bit;
+			tp_policy_discharging &= ~bit; /* the EC forgets it */
+			continue;
+		}
+		state = bat_state_from_row(bat, rows[bat]);
+		percent = rows[bat][12];
+
+		r = tp_policy_find(bat, TP_POLICY_BATTERY);
+		if (!r) {
+			tp_policy_latched &= ~bit;
+		} else if (!on_ac) {
+			due = tp_policy_battery_since +
+			      (u64)r->hours * 3600 * NSEC_PER_SEC;
+			if (now >= due)
+				tp_policy_latched |= bit;
+			else if (!next || due < next)
+				next = due;
+		} else if (tp_policy_latched & bit) {
+			if (state == TP_SMAPI_BAT_IDLE && percent >= r->start)
+				tp_policy_latched &= ~bit; /* charged again */
+			else
+				watch = 1;
+		}
+		if (!(tp_policy_latched & bit))
+			r = tp_policy_find(bat, TP_POLICY_AC);
+		if (r)
+			tp_policy_set_thresh(bat, r->start, r->stop);
+
+		tp_policy_set_discharge(bat,
+			tp_policy_calibration(bat, on_ac, state, percent));
+		if (tp_policy_find(bat, TP_POLICY_CALIBRATE))
+			watch = 1;
+	}
+	tp_policy_watch = watch;
+	mutex_unlock(&tp_policy_mutex);
+
+	if (next)
+		mod_delayed_work(system_freezable_wq, &tp_policy_work,
+				 nsecs_to_jiffies(next - now) + 1);
+	else
+		cancel_delayed_work(&tp_policy_work);
+}
+
+static ssize_t show_charge_policy(
+	struct device *dev, struct device_attribute *attr, char *buf)
+{
+	const struct tp_policy_rule *r;
+	int len = 0;
+
+	mutex_lock(&tp_policy_mutex);
+	for (r = tp_policy; r < tp_policy + tp_policy_len; ++r) {
+		switch (r->kind) {
+		case TP_POLICY_AC:
+			len += sprintf(buf + len, "%d ac %d %d\n",
+				       r->bat, r->start, r->stop);
+			break;
+		case TP_POLICY_BATTERY:
+			len += sprintf(buf + len, "%d battery %u %d %d\n",
+				       r->bat, r->hours, r->start, r->stop);
+			break;
+		case TP_POLICY_CALIBRATE:
+			len += sprintf(buf + len, "%d calibrate\n", r->bat);
+			break;
+		}
+	}
+	mutex_unlock(&tp_policy_mutex);
+	return len;
+}
+
+/**
+ * parse_policy_rule - parse one line of the charge_policy attribute
+ * Returns 0 on success, -EINVAL if malformed.
+ */
+static int parse_policy_rule(const char *line, struct tp_policy_rule *r)
+{
+	char kind[16], junk;
+	int bat, a = 0, b = 0, c = 0;
+	int n = sscanf(line, "%d %15s %d %d %d %c",
+		       &bat, kind, &a, &b, &c, &junk);
+
+	if (n < 2 || bat < 0 || bat >= TP_MAX_BATS)
+		return -EINVAL;
+	memset(r, 0, sizeof(*r));
+	r->bat = bat;
+	if (!strcmp(kind, "calibrate") && n == 2) {
+		r->kind = TP_POLICY_CALIBRATE;
+		return 0;
+	}
+	if (!strcmp(kind, "ac") && n == 4) {
+		r->kind = TP_POLICY_AC;
+	} else if (!strcmp(kind, "battery") && n == 5 && a > 0) {
+		r->kind = TP_POLICY_BATTERY;
+		r->hours = a;
+		a = b;
+		b = c;
+	} else {
+		return -EINVAL;
+	}
+	if (a < MIN_THRESH_START || a > MAX_THRESH_START ||
+	    b < MIN_THRESH_STOP || b > MAX_THRESH_STOP ||
+	    b - a < MIN_THRESH_DELTA)
+		return -EINVAL;
+	r->start = a;
+	r->stop = b;
+	return 0;
+}
+
+/* Rules are separated by newlines or semicolons; writing "" clears all */
+static ssize_t store_charge_policy(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct tp_policy_rule rules[TP_POLICY_MAX_RULES];
+	char line[64];
+	const char *p = buf, *end = buf + count, *eol;
+	int i, n = 0, ret;
+
+	while (p < end) {
+		for (eol = p; eol < end && *eol != '\n' && *eol != ';'; ++eol)
+			;
+		if (eol - p >= sizeof(line))
+			return -EINVAL;
+		memcpy(line, p, eol - p);
+		line[eol - p] = '\0';
+		p = eol + 1;
+		if (!*skip_spaces(line))
+			continue;
+		if (n == TP_POLICY_MAX_RULES)
+			return -ENOSPC;
+		ret = parse_policy_rule(line, &rules[n]);
+		if (ret)
+			return ret;
+		for (i = 0; i < n; ++i)
+			if (rules[i].bat == rules[n].bat &&
+			    rules[i].kind == rules[n].kind)
+				return -EINVAL; /* one rule of each kind */
+		++n;
+	}
+
+	mutex_lock(&tp_policy_mutex);
+	memcpy(tp_policy, rules, n * sizeof(*rules));
+	tp_policy_len = n;
+	down(&smapi_mutex);
+	memset(failed_thresh, -1, sizeof(failed_thresh)); /* retry them */
+	memset(failed_force_discharge, -1, sizeof(failed_force_discharge));
+	up(&smapi_mutex);
+	mutex_unlock(&tp_policy_mutex);
+	tp_monitor_kick(0); /* evaluate now */
+	return count;
+}
+
+static void tp_policy_exit(void)
+{
+	int bat;
+
+	cancel_delayed_work_sync(&tp_policy_work);
+	/* Don't leave a calibration discharge running without us */
+	mutex_lock(&tp_policy_mutex);
+	for (bat = 0; bat < TP_MAX_BATS; ++bat)
+		tp_policy_set_discharge(bat, 0);
+	mutex_unlock(&tp_policy_mutex);
+}
+
+
+/*********************************************************************
+ * Battery hotplug monitor: batteries (e.g., in the Ultrabay) can come
+ * and go. We sample the presence bits in EC row 0x01 in the background,
+ * and immediately upon ACPI battery and AC adapter notifications. When a
+ * battery appears or disappears, its battery object is created or removed
+ * (which also drops any cached state and re-probes it) and a KOBJ_CHANGE
+ * uevent is sent for the smapi device.
+ *
+ * The status polling period is chosen by a governor after each sample:
+ * fast while a battery charges or discharges at a high current, slow when
+ * idle on AC or when nobody listens for events (ACPI notifications still
+ * wake us up), hotplug_poll_ms otherwise, and paused across suspend. The
+ * presence bits are still checked every hotplug_poll_ms, so that slow
+ * status polling doesn't delay hotplug uevents. The governor also slows
+ * down the perf PMU sampler while nothing is drawn from the batteries.
+ */
+
+static unsigned int hotplug_poll_ms = 2000;
+module_param_named(hotplug_poll_ms, hotplug_poll_ms, uint, 0600);
+MODULE_PARM_DESC(hotplug_poll_ms,
+		 "Battery monitor normal polling period (msec, 0=ACPI events only)");
+
+static unsigned int poll_fast_ms = 500;
+module_param_named(poll_fast_ms, poll_fast_ms, uint, 0600);
+MODULE_PARM_DESC(poll_fast_ms,
+		 "Battery monitor polling period at high current (msec)");
+
+static unsigned int poll_slow_ms = 10000;
+module_param_named(poll_slow_ms, poll_slow_ms, uint, 0600);
+MODULE_PARM_DESC(poll_slow_ms,
+		 "Battery monitor polling period when idle on AC or unobserved (msec)");
+
+static unsigned int poll_fast_ma = 1000;
+module_param_named(poll_fast_ma, poll_fast_ma, uint, 0600);
+MODULE_PARM_DESC(poll_fast_ma,
+		 "Battery current above which the monitor polls fast (mA)");
+
+static u8 tp_monitor_present;  /* last seen presence bits */
+static int tp_monitor_running;
+static int tp_monitor_suspended;
+static atomic_t tp_monitor_revalidate = ATOMIC_INIT(0);
+static atomic_t tp_monitor_eval = ATOMIC_INIT(1); /* status check due now */
+static u64 tp_monitor_eval_jiffies;	/* time of the last status check */
+static unsigned int tp_poll_interval_ms; /* chosen by the governor, 0=none */
+static const char *tp_poll_reason = "init";
+static int tp_poll_idle;	/* idle on AC: nothing drawn from batteries */
+
+static int tp_pmu_in_use(void);
+static void tp_pmu_kick(void);
+
+static void tp_monitor(struct work_struct *work);
+static DECLARE_DELAYED_WORK(tp_monitor_work, tp_monitor);
+
+/**
+ * tp_battery_uevent - tell userspace that a battery was added or removed
+ */
+static void tp_battery_uevent(int bat, int present)
+{
+	char bat_env[16], present_env[16];
+	char *envp[] = { bat_env, present_env, NULL };
+
+	snprintf(bat_env, sizeof(bat_env), "BATTERY=BAT%d", bat);
+	snprintf(present_env, sizeof(present_env), "PRESENT=%d", present);
+	kobject_uevent_env(&pdev->dev.kobj, KOBJ_CHANGE, envp);
+}
+
+/**
+ * tp_monitor_govern - choose the next polling period
+ * @present: presence bits from EC row 0x01
+ * @rows: EC row 0x01 of each battery
+ * @readers: whether anybody consumes the monitor's events
+ */
+static void tp_monitor_govern(u8 present, u8 rows[][TP_CONTROLLER_ROW_LEN],
+			      int readers)
+{
+	unsigned int ms = hotplug_poll_ms;
+	const char *reason = "normal";
+	int bat, active = 0, cur, idle = 0;
+	u8 state;
+
+	if (!hotplug_poll_ms) {
+		ms = 0;
+		reason = "disabled";
+	} else if (!readers) {
+		ms = max(poll_slow_ms, hotplug_poll_ms);
+		reason = "no readers";
+	} else {
+		for (bat = 0; bat < TP_MAX_BATS; ++bat) {
+			state = bat_state_from_row(bat, rows[bat]);
+			if (state != TP_SMAPI_BAT_CHARGING &&
+			    state != TP_SMAPI_BAT_DISCHARGING)
+				continue;
+			active = 1;
+			cur = (s16)(rows[bat][8] | (rows[bat][9] << 8));
+			if (abs(cur) >= poll_fast_ma) {
+				ms = min(poll_fast_ms, hotplug_poll_ms);
+				reason = (state == TP_SMAPI_BAT_CHARGING) ?
+					 "charging" : "discharging";
+				break;
+			}
+		}
+		if (!active && (present & EC_PRESENT_AC)) {
+			ms = max(poll_slow_ms, hotplug_poll_ms);
+			reason = "idle on AC";
+			idle = 1;
+		}
+	}
+
+	if (ms != tp_poll_interval_ms || reason != tp_poll_reason)
+		DPRINTK("polling every %u ms (%s)", ms, reason);
+	tp_poll_interval_ms = ms;
+	tp_poll_reason = reason;
+	if (tp_poll_idle && !idle)
+		tp_pmu_kick(); /* back to its normal rate right away */
+	tp_poll_idle = idle;
+}
+
+static void tp_monitor(struct work_struct *work)
+{
+	u8 rows[TP_MAX_BATS][TP_CONTROLLER_ROW_LEN];
+	u8 present, changed;
+	unsigned int ms;
+	int bat, ret, due, readers = tp_genl_listening() || tp_pmu_in_use() ||
+			   tp_policy_watch;
+
+	if (!refresh_power_row(0, rows[0])) {
+		present = rows[0][0] & EC_PRESENT_MASK;
+		changed = present ^ tp_monitor_present;
+		tp_monitor_present = present;
+		if (changed) /* we noticed before firmware told us */
+			tp_power_cache_invalidate();
+		mutex_lock(&tp_bats_mutex);
+		for (bat = 0; bat < TP_MAX_BATS; ++bat) {
+			if (!(changed & EC_PRESENT_BAT(bat)))
+				continue;
+			tp_battery_remove(bat);
+			forget_known_settings(bat);
+			if ((present & EC_PRESENT_BAT(bat)) &&
+			    (ret = tp_battery_add(bat))) {
+				TPRINTK(KERN_ERR, "cannot add BAT%d (ret=%d)",
+					bat, ret);
+				/* Don't latch it, so the next tick retries */
+				tp_monitor_present &= ~EC_PRESENT_BAT(bat);
+				continue;
+			}
+			TPRINTK(KERN_INFO, "BAT%d %s", bat,
+				(present & EC_PRESENT_BAT(bat)) ?
+				"inserted" : "removed");
+			tp_battery_uevent(bat, !!(present & EC_PRESENT_BAT(bat)));
+			tp_genl_event(TP_SMAPI_CMD_BAT_PRESENT, bat,
+				      TP_SMAPI_A_PRESENT,
+				      !!(present & EC_PRESENT_BAT(bat)));
+		}
+		mutex_unlock(&tp_bats_mutex);
+		if (changed & EC_PRESENT_AC)
+			tp_genl_event(TP_SMAPI_CMD_AC, -1, TP_SMAPI_A_AC,
+				      !!(present & EC_PRESENT_AC));
+
+		/* Status checks go at the governed pace */
+		due = atomic_xchg(&tp_monitor_eval, 0) || changed ||
+		      time_after_eq64(get_jiffies_64(), tp_monitor_eval_jiffies +
+				      msecs_to_jiffies(tp_poll_interval_ms));
+		if (due) {
+			tp_monitor_eval_jiffies = get_jiffies_64();
+			/* Battery 1's status needs its own read; skip if unseen */
+			if (!readers || !(present & EC_PRESENT_BAT1) ||
+			    refresh_power_row(1, rows[1]))
+				memset(rows[1], 0, sizeof(rows[1]));
+			tp_genl_monitor(rows);
+			tp_policy_eval(present, rows);
+			tp_monitor_govern(present, rows, readers);
+		}
+	}
+
+	/* Check for swaps that the presence bits can't tell us about */
+	if (atomic_xchg(&tp_monitor_revalidate, 0)) {
+		mutex_lock(&tp_bats_mutex);
+		for (bat = 0; bat < TP_MAX_BATS; ++bat)
+			if (tp_bats[bat])
+				tp_battery_revalidate(tp_bats[bat]);
+		mutex_unlock(&tp_bats_mutex);
+	}
+
+	/* Check presence at least every hotplug_poll_ms */
+	ms = tp_poll_interval_ms;
+	if (hotplug_poll_ms && (!ms || hotplug_poll_ms < ms))
+		ms = hotplug_poll_ms;
+	if (tp_monitor_running && !tp_monitor_suspended && ms)
+		queue_delayed_work(system_freezable_wq, &tp_monitor_work,
+				   msecs_to_jiffies(ms));
+}
+
+/**
+ * tp_monitor_kick - make the monitor check for changes right away
+ * @revalidate: also check whether cached static battery info is still valid
+ */
+static void tp_monitor_kick(int revalidate)
+{
+	if (revalidate)
+		atomic_set(&tp_monitor_revalidate, 1);
+	atomic_set(&tp_monitor_eval, 1);
+	if (tp_monitor_running && !tp_monitor_suspended)
+		mod_delayed_work(system_freezable_wq, &tp_monitor_work, 0);
+}
+
+/**
+ * tp_monitor_suspend - stop polling until tp_monitor_resume()
+ */
+static void tp_monitor_suspend(void)
+{
+	tp_monitor_suspended = 1;
+	cancel_delayed_work_sync(&tp_monitor_work);
+	tp_poll_interval_ms = 0;
+	tp_poll_reason = "suspended";
+}
+
+static void tp_monitor_resume(void)
+{
+	tp_power_cache_invalidate();
+	tp_monitor_suspended = 0;
+	tp_monitor_kick(1); /* batteries may have been swapped while asleep */
+}
+
+static ssize_t show_poll_interval_ms(
+	struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", tp_poll_interval_ms);
+}
+
+static ssize_t show_poll_reason(
+	struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", tp_poll_reason);
+}
+
+#ifdef CONFIG_ACPI
+static int tp_acpi_notify(struct notifier_block *nb, unsigned long val,
+			  void *data)
+{
+	struct acpi_bus_event *event = data;
+	if (!strcmp(event->device_class, "battery")) {
+		tp_power_cache_invalidate();
+		tp_monitor_kick(1);
+	} else if (!strcmp(event->device_class, "ac_adapter")) {
+		tp_power_cache_invalidate();
+		tp_monitor_kick(0);
+	}
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block tp_acpi_nb = {
+	.notifier_call = tp_acpi_notify,
+};
+
+/* Is there an ACPI device with this hardware ID? */
+static int __init tp_acpi_dev_present(const char *hid)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	return acpi_dev_present(hid, NULL, -1);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	return acpi_dev_present(hid);
+#else
+	return 1; /* can't tell; assume firmware sends events */
+#endif
+}
+
+/* debugfs acpi_notify: writing a device class (e.g. "battery" or
+ * "ac_adapter") feeds a synthetic event through our notifier, for
+ * testing the cache invalidation path without real firmware events. */
+static ssize_t tp_debugfs_acpi_notify_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct acpi_bus_event event;
+	char class[sizeof(event.device_class)];
+
+	if (count >= sizeof(class))
+		return -EINVAL;
+	if (copy_from_user(class, ubuf, count))
+		return -EFAULT;
+	class[count] = '\0';
+	memset(&event, 0, sizeof(event));
+	snprintf(event.device_class, sizeof(event.device_class), "%s",
+		 strim(class));
+	tp_acpi_notify(&tp_acpi_nb, 0, &event);
+	return count;
+}
+
+static const struct file_operations tp_debugfs_acpi_notify_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = tp_debugfs_acpi_notify_write,
+	.llseek = noop_llseek,
+};
+
+static void __init tp_acpi_debugfs_init(struct dentry *dir)
+{
+	debugfs_create_file("acpi_notify", 0200, dir, NULL,
+			    &tp_debugfs_acpi_notify_fops);
+}
+#else
+static inline void tp_acpi_debugfs_init(struct dentry *dir) {}
+#endif
+
+static void __init tp_monitor_init(u8 present)
+{
+	tp_monitor_present = present;
+	tp_monitor_running = 1;
+	tp_power_cache_enabled = 1;
+#ifdef CONFIG_ACPI
+	/* Events only come if firmware has an AC adapter or battery device */
+	if (!register_acpi_notifier(&tp_acpi_nb) &&
+	    (tp_acpi_dev_present("ACPI0003") || tp_acpi_dev_present("PNP0C0A")))
+		tp_power_cache_events = 1;
+#endif
+	/* The first sample sets up the governor */
+	queue_delayed_work(system_freezable_wq, &tp_monitor_work, 0);
+}
+
+static void tp_monitor_exit(void)
+{
+	tp_power_cache_enabled = 0;
+	tp_power_cache_events = 0;
+	tp_power_cache_invalidate();
+#ifdef CONFIG_ACPI
+	unregister_acpi_notifier(&tp_acpi_nb);
+#endif
+	tp_monitor_running = 0;
+	cancel_delayed_work_sync(&tp_monitor_work);
+}
+
+
+/*********************************************************************
+ * perf PMU: battery energy and power as perf events, e.g.
+ *   perf stat -e tp_smapi/energy_bat0/ ./workload
+ *
+ * Like the RAPL power PMU, these are free-running system-wide counters.
+ * They are maintained by a background sampler that reads EC row 0x01 of
+ * each battery every pmu_sample_ms while any event is active, or every
+ * poll_slow_ms while the monitor's governor finds us idle on AC. The PMU
+ * callbacks run in atomic context, so they only look at the counters.
+ */
+
+#ifdef CONFIG_PERF_EVENTS
+
+enum tp_pmu_event {
+	TP_PMU_ENERGY_BAT0 = 1, /* energy drawn from battery 0, in uJ */
+	TP_PMU_ENERGY_BAT1,     /* energy drawn from battery 1, in uJ */
+	TP_PMU_POWER_NOW,       /* total power drawn from batteries, in mW */
+	TP_PMU_EVENT_MAX = TP_PMU_POWER_NOW
+};
+
+#define TP_PMU_MIN_SAMPLE_MS 10 /* don't hog the EC (or spin on 0) */
+
+static unsigned int pmu_sample_ms = 100;
+module_param_named(pmu_sample_ms, pmu_sample_ms, uint, 0600);
+MODULE_PARM_DESC(pmu_sample_ms,
+		 "perf PMU battery sampling period (msec, min 10)");
+
+static atomic64_t tp_pmu_energy_uj[2]; /* cumulative, never reset */
+static atomic_t tp_pmu_power_mw;       /* latest sample */
+static int tp_pmu_drawn_mw[2];         /* per battery, at the last sample */
+static atomic_t tp_pmu_active;         /* number of started events */
+static u64 tp_pmu_last_ns;             /* time of last sample, 0=none */
+
+static void tp_pmu_sample(struct work_struct *work);
+static DECLARE_DELAYED_WORK(tp_pmu_work, tp_pmu_sample);
+
+/* Sampling period, as governed by the battery monitor */
+static unsigned int tp_pmu_period_ms(void)
+{
+	unsigned int ms = max_t(unsigned int, pmu_sample_ms,
+				TP_PMU_MIN_SAMPLE_MS);
+	return tp_poll_idle ? max(ms, poll_slow_ms) : ms;
+}
+
+/* Leaving idle: sample now, so the next interval is at the normal rate */
+static void tp_pmu_kick(void)
+{
+	if (atomic_read(&tp_pmu_active))
+		mod_delayed_work(system_freezable_wq, &tp_pmu_work, 0);
+}
+
+/**
+ * tp_pmu_sample - sample battery power and integrate it into energy
+ * Runs from a freezable workqueue, so it can sleep on the EC lock and
+ * does not touch the EC during suspend. The power seen at each sample is
+ * taken to hold until the next one, which the monitor schedules early
+ * when leaving idle.
+ */
+static void tp_pmu_sample(struct work_struct *work)
+{
+	u8 row[TP_CONTROLLER_ROW_LEN];
+	u64 now = ktime_get_ns();
+	u64 dt_us = tp_pmu_last_ns ? (now - tp_pmu_last_ns) / NSEC_PER_USEC
+				   : 0;
+	int bat, mw, drawn_mw = 0;
+
+	for (bat = 0; bat < 2; ++bat) {
+		atomic64_add((u64)tp_pmu_drawn_mw[bat] * dt_us / 1000,
+			     &tp_pmu_energy_uj[bat]); /* mW*usec = nJ */
+		if (read_tp_ec_row(1, bat, 0, row))
+			mw = 0;
+		else if (!(row[0] & (bat?0x20:0x40)) || !(row[1] & 0x60))
+			mw = 0; /* no battery, or no status */
+		else /* Negative current means discharging */
+			mw = *(s16 *)(row+8) * (int)*(u16 *)(row+6) / 1000;
+		tp_pmu_drawn_mw[bat] = (mw < 0) ? -mw : 0;
+		drawn_mw += tp_pmu_drawn_mw[bat];
+	}
+	atomic_set(&tp_pmu_power_mw, drawn_mw);
+	tp_pmu_last_ns = now;
+
+	if (atomic_read(&tp_pmu_active))
+		queue_delayed_work(system_freezable_wq, &tp_pmu_work,
+				   msecs_to_jiffies(tp_pmu_period_ms()));
+	else
+		tp_pmu_last_ns = 0; /* don't integrate across idle gaps */
+}
+
+static struct pmu tp_pmu;
+
+static u64 tp_pmu_read_counter(struct perf_event *event)
+{
+	switch (event->hw.config) {
+	case TP_PMU_ENERGY_BAT0:
+		return atomic64_read(&tp_pmu_energy_uj[0]);
+	case TP_PMU_ENERGY_BAT1:
+		return atomic64_read(&tp_pmu_energy_uj[1]);
+	default:
+		return atomic_read(&tp_pmu_power_mw);
+	}
+}
+
+static void tp_pmu_event_update(struct perf_event *event)
+{
+	u64 prev, now;
+
+	do {
+		prev = local64_read(&event->hw.prev_count);
+		now = tp_pmu_read_counter(event);
+	} while (local64_cmpxchg(&event->hw.prev_count, prev, now) != prev);
+	local64_add(now - prev, &event->count);
+}
+
+static void tp_pmu_event_start(struct perf_event *event, int flags)
+{
+	/* Energy counts from now on; power is a gauge, so it counts from 0 */
+	local64_set(&event->hw.prev_count,
+		    event->hw.config == TP_PMU_POWER_NOW ?
+		    0 : tp_pmu_read_counter(event));
+	event->hw.state = 0;
+	if (atomic_inc_return(&tp_pmu_active) == 1) {
+		mod_delayed_work(system_freezable_wq, &tp_pmu_work, 0);
+		tp_monitor_kick(0); /* let the poll governor see the reader */
+	}
+}
+
+static void tp_pmu_event_stop(struct perf_event *event, int flags)
+{
+	if (event->hw.state & PERF_HES_STOPPED)
+		return;
+	tp_pmu_event_update(event);
+	event->hw.state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+	atomic_dec(&tp_pmu_active);
+}
+
+static int tp_pmu_event_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+	if (flags & PERF_EF_START)
+		tp_pmu_event_start(event, flags);
+	return 0;
+}
+
+static void tp_pmu_event_del(struct perf_event *event, int flags)
+{
+	tp_pmu_event_stop(event, PERF_EF_UPDATE);
+}
+
+static int tp_pmu_event_init(struct perf_event *event)
+{
+	u64 cfg = event->attr.config & 0xFF;
+
+	if (event->attr.type != tp_pmu.type)
+		return -ENOENT;
+	/* System-wide counting only: no sampling, no per-task events */
+	if (is_sampling_event(event) || event->attach_state & PERF_ATTACH_TASK)
+		return -EINVAL;
+	if (event->cpu < 0)
+		return -EINVAL;
+	if (cfg < TP_PMU_ENERGY_BAT0 || cfg > TP_PMU_EVENT_MAX)
+		return -EINVAL;
+	event->hw.config = cfg;
+	return 0;
+}
+
+/* Counters are global, so advertise a single CPU to make perf tools
+ * open one system-wide event (also when given a workload to run). */
+static ssize_t show_pmu_cpumask(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return cpumap_print_to_pagebuf(true, buf, cpumask_of(0));
+}
+static struct device_attribute dev_attr_pmu_cpumask =
+	__ATTR(cpumask, 0444, show_pmu_cpumask, NULL);
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+PMU_EVENT_ATTR_STRING(energy_bat0, tp_pmu_energy_bat0, "event=0x01");
+PMU_EVENT_ATTR_STRING(energy_bat0.unit, tp_pmu_energy_bat0_unit, "Joules");
+PMU_EVENT_ATTR_STRING(energy_bat0.scale, tp_pmu_energy_bat0_scale, "1e-6");
+PMU_EVENT_ATTR_STRING(energy_bat1, tp_pmu_energy_bat1, "event=0x02");
+PMU_EVENT_ATTR_STRING(energy_bat1.unit, tp_pmu_energy_bat1_unit, "Joules");
+PMU_EVENT_ATTR_STRING(energy_bat1.scale, tp_pmu_energy_bat1_scale, "1e-6");
+PMU_EVENT_ATTR_STRING(power_now, tp_pmu_power_now, "event=0x03");
+PMU_EVENT_ATTR_STRING(power_now.unit, tp_pmu_power_now_unit, "Watts");
+PMU_EVENT_ATTR_STRING(power_now.scale, tp_pmu_power_now_scale, "1e-3");
+
+static struct attribute *tp_pmu_events_attrs[] = {
+	&tp_pmu_energy_bat0.attr.attr,
+	&tp_pmu_energy_bat0_unit.attr.attr,
+	&tp_pmu_energy_bat0_scale.attr.attr,
+	&tp_pmu_energy_bat1.attr.attr,
+	&tp_pmu_energy_bat1_unit.attr.attr,
+	&tp_pmu_energy_bat1_scale.attr.attr,
+	&tp_pmu_power_now.attr.attr,
+	&tp_pmu_power_now_unit.attr.attr,
+	&tp_pmu_power_now_scale.attr.attr,
+	NULL
+};
+
+static struct attribute *tp_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL
+};
+
+static struct attribute *tp_pmu_cpumask_attrs[] = {
+	&dev_attr_pmu_cpumask.attr,
+	NULL
+};
+
+static struct attribute_group tp_pmu_events_group = {
+	.name  = "events",
+	.attrs = tp_pmu_events_attrs
+};
+
+static struct attribute_group tp_pmu_format_group = {
+	.name  = "format",
+	.attrs = tp_pmu_format_attrs
+};
+
+static struct attribute_group tp_pmu_cpumask_group = {
+	.attrs = tp_pmu_cpumask_attrs
+};
+
+static const struct attribute_group *tp_pmu_attr_groups[] = {
+	&tp_pmu_events_group,
+	&tp_pmu_format_group,
+	&tp_pmu_cpumask_group,
+	NULL
+};
+
+static struct pmu tp_pmu = {
+	.attr_groups	= tp_pmu_attr_groups,
+	.task_ctx_nr	= perf_invalid_context,
+	.event_init	= tp_pmu_event_init,
+	.add		= tp_pmu_event_add,
+	.del		= tp_pmu_event_del,
+	.start		= tp_pmu_event_start,
+	.stop		= tp_pmu_event_stop,
+	.read		= tp_pmu_event_update,
+	.module		= THIS_MODULE,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+	.capabilities	= PERF_PMU_CAP_NO_INTERRUPT | PERF_PMU_CAP_NO_EXCLUDE,
+#else
+	.capabilities	= PERF_PMU_CAP_NO_INTERRUPT,
+#endif
+};
+
+static int tp_pmu_registered;
+
+static int tp_pmu_in_use(void)
+{
+	return atomic_read(&tp_pmu_active) > 0;
+}
+
+static void __init tp_pmu_init(void)
+{
+	int ret = perf_pmu_register(&tp_pmu, "tp_smapi", -1);
+	if (ret)
+		printk(KERN_WARNING "tp_smapi: cannot register perf PMU "
+		       "(ret=%d), continuing without it\n", ret);
+	else
+		tp_pmu_registered = 1;
+}
+
+static void tp_pmu_exit(void)
+{
+	if (tp_pmu_registered)
+		perf_pmu_unregister(&tp_pmu);
+	cancel_delayed_work_sync(&tp_pmu_work);
+}
+
+#else /* CONFIG_PERF_EVENTS */
+
+static int tp_pmu_in_use(void)
+{
+	return 0;
+}
+
+static void tp_pmu_kick(void) {}
+static inline void tp_pmu_init(void) {}
+static inline void tp_pmu_exit(void) {}
+
+#endif /* CONFIG_PERF_EVENTS */
+
+
+/*********************************************************************
+ * Init and cleanup
+ */
+
+static int __init tp_init(void)
+{
+	int ret, bat;
+	u8 row[TP_CONTROLLER_ROW_LEN];
+	printk(KERN_INFO "tp_smapi " TP_VERSION " loading...\n");
+
+	ret = find_smapi_port();
+	if (ret < 0)
+		goto err;
+	else
+		smapi_port = ret;
+
+	if (!request_region(smapi_port, 1, "smapi")) {
+		printk(KERN_ERR "tp_smapi cannot claim port 0x%x\n",
+		       smapi_port);
+		ret = -ENXIO;
+		goto err;
+	}
+
+	if (!request_region(SMAPI_PORT2, 1, "smapi")) {
+		printk(KERN_ERR "tp_smapi cannot claim port 0x%x\n",
+		       SMAPI_PORT2);
+		ret = -ENXIO;
+		goto err_port1;
+	}
+
+	ret = platform_driver_register(&tp_driver);
+	if (ret)
+		goto err_port2;
+
+	pdev = platform_device_alloc("smapi", -1);
+	if (!pdev) {
+		ret = -ENOMEM;
+		goto err_driver;
+	}
+
+	ret = platform_device_add(pdev);
+	if (ret)
+		goto err_device_free;
+
+	ret = sysfs_create_group(&pdev->dev.kobj, &tp_root_attribute_group);
+	if (ret)
+		goto err_device;
+
+	/* Create battery objects only for batteries that are present. If
+	 * the EC doesn't answer now, the monitor adds them when it does. */
+	if (read_tp_ec_row(1, 0, 0, row)) {
+		TPRINTK(KERN_NOTICE, "cannot read battery presence yet");
+		row[0] = 0;
+	}
+	for (bat = 0; bat < TP_MAX_BATS; ++bat) {
+		if (!(row[0] & EC_PRESENT_BAT(bat)))
+			continue;
+		ret = tp_battery_add(bat);
+		if (ret)
+			goto err_bats;
+	}
+
+	tp_genl_init();
+	tp_monitor_init(row[0] & EC_PRESENT_MASK);
+	tp_pmu_init();
+	tp_debugfs_init();
+
+	printk(KERN_INFO "tp_smapi successfully loaded (smapi_port=0x%x).\n",
+	       smapi_port);
+	return 0;
+
+err_bats:
+	for (bat = 0; bat < TP_MAX_BATS; ++bat)
+		tp_battery_remove(bat);
+	sysfs_remove_group(&pdev->dev.kobj, &tp_root_attribute_group);
+err_device:
+	platform_device_unregister(pdev);
+	goto err_driver;
+err_device_free:
+	platform_device_put(pdev);
+err_driver:
+	platform_driver_unregister(&tp_driver);
+err_port2:
+	release_region(SMAPI_PORT2, 1);
+err_port1:
+	release_region(smapi_port, 1);
+err:
+	printk(KERN_ERR "tp_smapi init failed (ret=%d)!\n", ret);
+	return ret;
+}
+
+static void __exit tp_exit(void)
+{
+	int bat;
+
+	tp_debugfs_exit();
+	tp_pmu_exit();
+	tp_monitor_exit();
+	tp_policy_exit();
+	tp_genl_exit();
+	for (bat = 0; bat < TP_MAX_BATS; ++bat)
+		tp_battery_remove(bat);
+	sysfs_remove_group(&pdev->dev.kobj, &tp_root_attribute_group);
 	platform_device_unregister(pdev);
 	platform_driver_unregister(&tp_driver);
 	release_region(SMAPI_PORT2, 1);
@@ -0,0 +1,79 @@
+/*
+ *  tp_smapi.h - interface to the tp_smapi generic netlink family
+ *
+ *  This header is shared by the tp_smapi module and userspace listeners.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _TP_SMAPI_H
+#define _TP_SMAPI_H
+
+#include <linux/types.h>
+
+/*
+ * Generic netlink family. Events are multicast on the "events" group as
+ * TP_SMAPI_CMD_* messages carrying the attributes listed for each.
+ */
+#define TP_SMAPI_GENL_NAME	"tp_smapi"
+#define TP_SMAPI_GENL_VERSION	1
+#define TP_SMAPI_GENL_MCGRP	"events"
+
+enum tp_smapi_cmd {
+	TP_SMAPI_CMD_UNSPEC,
+	TP_SMAPI_CMD_BAT_STATE,	  /* event: A_BAT, A_STATE */
+	TP_SMAPI_CMD_BAT_PRESENT, /* event: A_BAT, A_PRESENT */
+	TP_SMAPI_CMD_AC,	  /* event: A_AC */
+	TP_SMAPI_CMD_THRESH,	  /* event: A_BAT, A_THRESH_START or _STOP */
+	TP_SMAPI_CMD_SUMMARY,	  /* event: A_AC, A_SUMMARY per battery */
+	TP_SMAPI_CMD_SET_SUMMARY_INTERVAL, /* request: A_INTERVAL_MS */
+	__TP_SMAPI_CMD_MAX,
+};
+#define TP_SMAPI_CMD_MAX (__TP_SMAPI_CMD_MAX - 1)
+
+enum tp_smapi_attr {
+	TP_SMAPI_A_UNSPEC,
+	TP_SMAPI_A_BAT,		 /* u8: battery number */
+	TP_SMAPI_A_STATE,	 /* u8: enum tp_smapi_bat_state */
+	TP_SMAPI_A_PRESENT,	 /* u8: 0 or 1 */
+	TP_SMAPI_A_AC,		 /* u8: 0 or 1 */
+	TP_SMAPI_A_THRESH_START, /* u8: percent */
+	TP_SMAPI_A_THRESH_STOP,	 /* u8: percent */
+	TP_SMAPI_A_SUMMARY,	 /* struct tp_smapi_bat_summary */
+	TP_SMAPI_A_INTERVAL_MS,	 /* u32: summary interval, 0=off */
+	__TP_SMAPI_A_MAX,
+};
+#define TP_SMAPI_A_MAX (__TP_SMAPI_A_MAX - 1)
+
+enum tp_smapi_bat_state {
+	TP_SMAPI_BAT_NONE,	  /* not installed, or no status */
+	TP_SMAPI_BAT_IDLE,
+	TP_SMAPI_BAT_DISCHARGING,
+	TP_SMAPI_BAT_CHARGING,
+	TP_SMAPI_BAT_UNKNOWN,
+};
+
+struct tp_smapi_bat_summary {
+	__u8  bat;		  /* battery number */
+	__u8  state;		  /* enum tp_smapi_bat_state */
+	__u8  remaining_percent;
+	__u8  reserved;
+	__s16 current_now;	  /* mA */
+	__u16 voltage;		  /* mV */
+	__s32 power_now;	  /* mW */
+	__u32 remaining_capacity; /* mWh */
+};
+
+#endif /* _TP_SMAPI_H */